@@ -0,0 +1,255 @@
+/**
+ * Allocation of the matrix and the buffers of its shape, on huge pages
+ * if requested.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ * A row of the matrix is 16 kB at the default size, so the north and
+ * south neighbours of a point are several 4 kB pages away from it, and
+ * a sweep over a large matrix keeps missing in the TLB. Huge pages
+ * cover the rows of a strip with a handful of entries.
+ */
+
+#if defined(__linux__)
+/* Needed for MAP_ANONYMOUS, MAP_HUGETLB and madvise() */
+#define _GNU_SOURCE
+#endif
+
+#if defined(__sun)
+/* Must be defined to get memalign() since it isn't POSIX. We'd really
+ * like to use posix_memalign instead, but Solaris doesn't implement
+ * that.
+ */
+#define __EXTENSIONS__
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "gs_alloc.h"
+
+/* Align the matrix on a 4kB boundary */
+#define MATRIX_ALIGNMENT 0x1000
+
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/* Names of the page sizes, indexed by enum gs_pages */
+static const char *pages_names[] = {
+        [GS_PAGES_DEFAULT] = "default",
+        [GS_PAGES_THP] = "thp",
+        [GS_PAGES_2M] = "2m",
+        [GS_PAGES_1G] = "1g",
+};
+
+const char *
+gs_pages_name(int pages)
+{
+        return pages_names[pages];
+}
+
+size_t
+gs_pages_size(int pages)
+{
+        switch (pages) {
+        case GS_PAGES_THP:
+        case GS_PAGES_2M:
+                return HUGE_2M;
+        case GS_PAGES_1G:
+                return HUGE_1G;
+        default:
+                return sysconf(_SC_PAGESIZE);
+        }
+}
+
+int
+gs_pages_find(const char *name)
+{
+        for (int k = GS_PAGES_DEFAULT; k <= GS_PAGES_1G; k++) {
+                if (!strcmp(name, pages_names[k]))
+                        return k;
+        }
+
+        return -1;
+}
+
+#if defined(__linux__)
+
+/**
+ * Check if the kernel hands out transparent huge pages to regions
+ * that madvise() asks for them.
+ */
+static int
+thp_enabled()
+{
+        FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+        char line[128];
+        int enabled = 0;
+
+        if (!f)
+                return 0;
+        if (fgets(line, sizeof(line), f))
+                enabled = !strstr(line, "[never]");
+        fclose(f);
+
+        return enabled;
+}
+
+/**
+ * Map size bytes from the hugetlb pool. Fails right away if the pool
+ * can't reserve enough pages.
+ */
+static int
+map_hugetlb(struct gs_buffer *buf, size_t size, size_t page, int shift,
+            int populate)
+{
+        size_t len = (size + page - 1) & ~(page - 1);
+        void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                          (shift << MAP_HUGE_SHIFT) |
+                          (populate ? MAP_POPULATE : 0), -1, 0);
+
+        if (addr == MAP_FAILED)
+                return -1;
+
+        buf->addr = addr;
+        buf->mapped = len;
+        return 0;
+}
+
+/**
+ * Map size bytes aligned to 2 MB, so that the kernel can back all of
+ * it with transparent huge pages, and ask it to. The mapping is made
+ * larger and trimmed to get the alignment.
+ */
+static int
+map_thp(struct gs_buffer *buf, size_t size, int populate)
+{
+        size_t len = (size + HUGE_2M - 1) & ~(HUGE_2M - 1);
+        char *addr = mmap(NULL, len + HUGE_2M, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        char *start;
+
+        if (addr == MAP_FAILED)
+                return -1;
+
+        start = (char *)(((size_t)addr + HUGE_2M - 1) & ~(HUGE_2M - 1));
+        if (start > addr)
+                munmap(addr, start - addr);
+        munmap(start + len, addr + HUGE_2M - start);
+
+        if (madvise(start, len, MADV_HUGEPAGE) != 0) {
+                munmap(start, len);
+                return -1;
+        }
+        /* Fault in the pages after madvise(), so they are huge already.
+         * MAP_POPULATE would fault them in as small pages. */
+        for (size_t off = 0; populate && off < len; off += HUGE_2M)
+                start[off] = 0;
+
+        buf->addr = start;
+        buf->mapped = len;
+        return 0;
+}
+
+/**
+ * Map size bytes of small pages, fault them all in by MAP_POPULATE.
+ */
+static int
+map_populated(struct gs_buffer *buf, size_t size)
+{
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                          -1, 0);
+
+        if (addr == MAP_FAILED)
+                return -1;
+
+        buf->addr = addr;
+        buf->mapped = size;
+        return 0;
+}
+
+#endif
+
+int
+gs_buffer_alloc(struct gs_buffer *buf, size_t size, int pages, int populate)
+{
+        memset(buf, 0, sizeof(*buf));
+        buf->populated = populate;
+
+        /* mmap() doesn't take empty mappings */
+        size = size ? size : 1;
+
+#if defined(__linux__)
+        if (pages >= GS_PAGES_1G &&
+            map_hugetlb(buf, size, HUGE_1G, 30, populate) == 0) {
+                buf->pages = GS_PAGES_1G;
+                return 0;
+        }
+        if (pages >= GS_PAGES_2M &&
+            map_hugetlb(buf, size, HUGE_2M, 21, populate) == 0) {
+                buf->pages = GS_PAGES_2M;
+                return 0;
+        }
+        if (pages >= GS_PAGES_THP && thp_enabled() &&
+            map_thp(buf, size, populate) == 0) {
+                buf->pages = GS_PAGES_THP;
+                return 0;
+        }
+        if (populate && map_populated(buf, size) == 0) {
+                buf->pages = GS_PAGES_DEFAULT;
+                return 0;
+        }
+#endif
+
+        buf->pages = GS_PAGES_DEFAULT;
+#if defined(__sun)
+        /* Sigh... posix_memalign isn't implemented in Solaris, so we
+         * have to use the legacy version instead. */
+        buf->addr = memalign(MATRIX_ALIGNMENT, size);
+        if (!buf->addr)
+                return -1;
+#else
+        if (posix_memalign(&buf->addr, MATRIX_ALIGNMENT, size) != 0)
+                return -1;
+#endif
+        /* Small pages and no mmap(), fault them in by hand */
+        for (size_t off = 0; populate && off < size; off += MATRIX_ALIGNMENT)
+                ((char *)buf->addr)[off] = 0;
+
+        return 0;
+}
+
+void
+gs_buffer_free(struct gs_buffer *buf)
+{
+#if defined(__linux__)
+        if (buf->mapped) {
+                munmap(buf->addr, buf->mapped);
+                buf->addr = NULL;
+                return;
+        }
+#endif
+        free(buf->addr);
+        buf->addr = NULL;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
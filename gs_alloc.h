@@ -0,0 +1,85 @@
+/**
+ * Allocation of the matrix and the buffers of its shape, on huge pages
+ * if requested.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#ifndef GS_ALLOC_H
+#define GS_ALLOC_H
+
+#include <stddef.h>
+
+/**
+ * Pages backing an allocation. When the requested ones aren't
+ * available, the next smaller ones are tried, down to GS_PAGES_DEFAULT.
+ */
+enum gs_pages {
+        /** Whatever posix_memalign() gives us, usually 4 kB pages */
+        GS_PAGES_DEFAULT,
+        /** Transparent huge pages, asked for with madvise() */
+        GS_PAGES_THP,
+        /** 2 MB pages from the hugetlb pool */
+        GS_PAGES_2M,
+        /** 1 GB pages from the hugetlb pool */
+        GS_PAGES_1G,
+};
+
+/** A block of memory and how it was allocated */
+struct gs_buffer {
+        void *addr;
+        /** Length of the mapping, 0 if not mapped by mmap() */
+        size_t mapped;
+        /** Pages that took effect, see enum gs_pages */
+        int pages;
+        /** 1 if every page was faulted in by the allocation */
+        int populated;
+};
+
+/**
+ * Allocate size bytes aligned to at least 4 kB.
+ *
+ * \param pages Pages to back the memory with, see enum gs_pages
+ * \param populate 1 to fault in every page now, rather than on first
+ *                 touch. All of them are then placed on the NUMA node
+ *                 of the calling thread.
+ * \return 0 on success, -1 if not even GS_PAGES_DEFAULT worked
+ */
+extern int gs_buffer_alloc(struct gs_buffer *buf, size_t size, int pages,
+                           int populate);
+
+/**
+ * Free memory allocated by gs_buffer_alloc().
+ */
+extern void gs_buffer_free(struct gs_buffer *buf);
+
+/**
+ * Get the name of a page size, e.g. "2m".
+ */
+extern const char *gs_pages_name(int pages);
+
+/**
+ * Get the size of a page, in bytes. For GS_PAGES_THP, that of the
+ * huge pages the kernel will hopefully use.
+ */
+extern size_t gs_pages_size(int pages);
+
+/**
+ * Find a page size by name.
+ *
+ * \return One of enum gs_pages, -1 if name is unknown
+ */
+extern int gs_pages_find(const char *name);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
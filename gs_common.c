@@ -9,28 +9,18 @@
  *
  */
 
-#if defined(__sun)
-/* Must be defined to get memalign() since it isn't POSIX. We'd really
- * like to use posix_memalign instead, but Solaris doesn't implement
- * that.
- */
-#define __EXTENSIONS__
-#endif
-
 #include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
-#include <math.h>
+#include <string.h>
 #include <time.h>
 
 #include "timing.h"
+#include "topology.h"
+#include "gs_kernel.h"
 #include "gs_interface.h"
 
-/* Align the matrix on a 4kB boundary */
-#define MATRIX_ALIGNMENT 0x1000
-
 /*
  * Default values for parameters that can be specified on the command
  * line.
@@ -38,53 +28,173 @@
 #define DEFAULT_SIZE               2048
 #define DEFAULT_ITERATIONS           20
 #define DEFAULT_TOLERANCE             1.0
-#define DEFAULT_NTHREADS              4
 #define DEFAULT_PAD                   0
+#define DEFAULT_TILE_ROWS             0
+#define DEFAULT_TILE_COLS             0
+#define DEFAULT_WAIT_POLICY           GS_WAIT_FUTEX
+#define DEFAULT_KERNEL                "auto"
+#define DEFAULT_TEMPORAL_DEPTH        1
+#define DEFAULT_PANEL_COLS            0
+#define DEFAULT_BACKEND               "seq"
+#define DEFAULT_BATCH                 0
+#define DEFAULT_OMEGA                 1.0
+#define DEFAULT_CYCLE                 GS_CYCLE_V
+#define DEFAULT_PAGES                 GS_PAGES_DEFAULT
+#define DEFAULT_LAYOUT                GS_LAYOUT_ROWS
+
+/* Threads to start by default if the CPUs we may run on can't be
+ * counted, otherwise there is one per CPU */
+#define FALLBACK_NTHREADS             4
+
+/* Maximum number of backends that can be selected */
+#define MAX_BACKENDS                 16
 
 /* Parameter values */
-int gs_verbose = 0;
-FILE* gs_output = NULL;
+static struct gs_params params = {
+        .backend = DEFAULT_BACKEND,
+        .size = DEFAULT_SIZE,
+        .pad = DEFAULT_PAD,
+        .iterations = DEFAULT_ITERATIONS,
+        .tolerance = DEFAULT_TOLERANCE,
+        .nthreads = FALLBACK_NTHREADS,
+        .tile_rows = DEFAULT_TILE_ROWS,
+        .tile_cols = DEFAULT_TILE_COLS,
+        .wait_policy = DEFAULT_WAIT_POLICY,
+        .temporal_depth = DEFAULT_TEMPORAL_DEPTH,
+        .panel_cols = DEFAULT_PANEL_COLS,
+        .omega = DEFAULT_OMEGA,
+        .cycle = DEFAULT_CYCLE,
+        .pages = DEFAULT_PAGES,
+        .layout = DEFAULT_LAYOUT,
+};
+static FILE *gs_output = NULL;
+/* Number of problems to solve in batch mode, 0 for a single solve */
+static int gs_batch = DEFAULT_BATCH;
+/* 1 if the problems of a batch are solved interleaved, several per thread */
+static int gs_interleave = 0;
+
+/* Names of the wait policies, indexed by enum gs_wait_policy */
+static const char *wait_policy_names[] = {
+        [GS_WAIT_SPIN] = "spin",
+        [GS_WAIT_BACKOFF] = "backoff",
+        [GS_WAIT_FUTEX] = "futex",
+};
+
+/* Names of the multigrid cycles, indexed by enum gs_cycle */
+static const char *cycle_names[] = {
+        [GS_CYCLE_V] = "v",
+        [GS_CYCLE_W] = "w",
+        [GS_CYCLE_FMG] = "fmg",
+};
+
+/* Names of the storage layouts, indexed by enum gs_layout */
+static const char *layout_names[] = {
+        [GS_LAYOUT_ROWS] = "rows",
+        [GS_LAYOUT_TILES] = "tiles",
+        [GS_LAYOUT_MORTON] = "morton",
+        [GS_LAYOUT_REDBLACK] = "redblack",
+};
+
+/* What the layouts are, for the usage text */
+static const char *layout_descriptions[] = {
+        [GS_LAYOUT_ROWS] = "Row after row",
+        [GS_LAYOUT_TILES] = "Square tiles, row by row",
+        [GS_LAYOUT_MORTON] = "The same tiles in Z-order",
+        [GS_LAYOUT_REDBLACK] = "Each colour of red-black apart",
+};
+
+/* Backends selected with -b, in the order they are run */
+static const struct gs_backend *selected[MAX_BACKENDS];
+static int nselected = 0;
+
+/* Options selected by -b that not every backend understands */
+static unsigned selected_options = 0;
+/* Layouts the backends selected by -b can sweep, see gs_backend.layouts */
+static unsigned selected_layouts = 0;
+
+/* Backend specific options, for the error messages and the usage text */
+static const struct {
+        unsigned option;
+        const char *flags;
+} option_flags[] = {
+        { GS_OPT_THREADS, "-t/-a" },
+        { GS_OPT_TILES, "-r/-c" },
+        { GS_OPT_WAIT, "-W" },
+        { GS_OPT_FUSE, "-T" },
+        { GS_OPT_PANELS, "-P" },
+        { GS_OPT_OMEGA, "-w" },
+        { GS_OPT_CYCLE, "-m" },
+};
 
-int gs_size = DEFAULT_SIZE;
-int gs_pad = DEFAULT_PAD;
-int gs_width;
-int gs_iterations = DEFAULT_ITERATIONS;
-double gs_tolerance = DEFAULT_TOLERANCE;
-int gs_nthreads = DEFAULT_NTHREADS;
+/**
+ * Select the backends in a comma separated list.
+ *
+ * \return 0 on success, -1 if a backend is unknown
+ */
+static int
+select_backends(const char *list)
+{
+        nselected = 0;
+        selected_options = 0;
+        selected_layouts = 0;
+        for (const char *name = list; ; name++) {
+                size_t len = strcspn(name, ",");
+                char buf[len + 1];
+                const struct gs_backend *backend;
+
+                memcpy(buf, name, len);
+                buf[len] = '\0';
+                backend = gs_backend_find(buf);
+                if (!backend || nselected == MAX_BACKENDS) {
+                        fprintf(stderr, "Unknown backend: %.*s\n",
+                                (int)len, name);
+                        return -1;
+                }
+                selected[nselected++] = backend;
+                selected_options |= backend->options;
+                selected_layouts |= backend->layouts;
 
-double *gs_matrix = NULL;
+                name += len;
+                if (!*name)
+                        return 0;
+        }
+}
 
-void
-gs_verbose_printf(const char *fmt, ...)
+/**
+ * Print the names of the backends that understand option, e.g.
+ * "(pth, rb)".
+ */
+static void
+print_option_backends(FILE *out, unsigned option)
 {
-        va_list ap;
-        va_start(ap, fmt);
+        const struct gs_backend *backend;
+        const char *sep = "(";
 
-        if (gs_verbose)
-                vprintf(fmt, ap);
-
-        va_end(ap);
+        for (int i = 0; (backend = gs_backend_get(i)); i++) {
+                if (backend->options & option) {
+                        fprintf(out, "%s%s", sep, backend->name);
+                        sep = ", ";
+                }
+        }
+        fprintf(out, ")\n");
 }
 
 /**
- * Initialization function that fills the matrix with suitable data.
+ * Print the names of the backends that can sweep layout, e.g. "(seq)".
  */
 static void
-init_matrix()
+print_layout_backends(FILE *out, int layout)
 {
-        const double sqrt3 = 1.73205080757;
-        const double size_inv = 1.0 / (gs_size - 1);
-        
-        gs_verbose_printf("\t****  Initializing the matrix  ****\n");
-
-        for (int i = 0; i < gs_size; i++) {
-                for(int j = 0; j < gs_size; j++)
-                        gs_matrix[GS_INDEX(i, j)] =
-                                sin(M_PI * i * size_inv) *
-                                sin(M_PI * j * size_inv) *
-                                sin(M_PI * M_SQRT2 * i * size_inv) * 
-                                sin(M_PI * sqrt3 * j * size_inv);
+        const struct gs_backend *backend;
+        const char *sep = "(";
+
+        for (int i = 0; (backend = gs_backend_get(i)); i++) {
+                if (backend->layouts & 1u << layout) {
+                        fprintf(out, "%s%s", sep, backend->name);
+                        sep = ", ";
+                }
         }
+        fprintf(out, ")\n");
 }
 
 /**
@@ -94,14 +204,53 @@ static void
 print_info()
 {
         printf("****  Runtime parameters ****\n");
-        printf("Grid size is: %d x %d\n", gs_size, gs_size);
-        printf("Iterations : %d\n", gs_iterations);
-        printf("Tolerance : %f\n", gs_tolerance);
-        printf("Pad = %d elements\n", gs_pad);
-        if (gsi_is_parallel)
-                printf("Number of threads : %d\n", gs_nthreads);
-        printf("Matrix using %dx%d * sizeof(double) bytes of memory\n",
-               gs_size, gs_width);
+        printf("Grid size is: %d x %d\n", params.size, params.size);
+        printf("Iterations : %d\n", params.iterations);
+        printf("Tolerance : %f\n", params.tolerance);
+        printf("Pad = %d elements\n", params.pad);
+        printf("Backend :");
+        for (int i = 0; i < nselected; i++)
+                printf(" %s", selected[i]->name);
+        printf("\n");
+        printf("Sweep kernel : %s\n", gs_kernel_name());
+        if (gs_batch && gs_interleave)
+                printf("Batch : %d problems, %d per thread at a time\n",
+                       gs_batch, GS_KERNEL_BATCH_LANES);
+        else if (gs_batch)
+                printf("Batch : %d problems, one per thread at a time\n",
+                       gs_batch);
+        if (selected_options & GS_OPT_FUSE)
+                printf("Sweeps fused per pass : %d\n",
+                       params.temporal_depth);
+        if (params.panel_cols == GS_PANELS_AUTO)
+                printf("Panel width : fit in cache\n");
+        else if (params.panel_cols)
+                printf("Panel width : %d\n", params.panel_cols);
+        if (selected_options & GS_OPT_OMEGA) {
+                if (params.omega == GS_OMEGA_AUTO)
+                        printf("Over-relaxation : estimated\n");
+                else if (params.omega != 1.0)
+                        printf("Over-relaxation : %f\n", params.omega);
+        }
+        if (selected_options & GS_OPT_CYCLE)
+                printf("Multigrid cycle : %s\n", cycle_names[params.cycle]);
+        if (selected_layouts)
+                printf("Layout : %s\n", layout_names[params.layout]);
+        if (selected_options & GS_OPT_THREADS)
+                printf("Number of threads : %d\n", params.nthreads);
+        if ((selected_options & GS_OPT_TILES) &&
+            (params.tile_rows || params.tile_cols))
+                printf("Tile size : %d x %d (0 = auto)\n",
+                       params.tile_rows, params.tile_cols);
+        if (selected_options & GS_OPT_WAIT)
+                printf("Wait policy : %s\n",
+                       wait_policy_names[params.wait_policy]);
+        if (selected_options & GS_OPT_THREADS)
+                printf("Thread binding : %s\n", topology_binding_name());
+        printf("Pages requested : %s%s\n", gs_pages_name(params.pages),
+               params.populate ? ", pre-faulted" : "");
+        printf("Matrix using %zu bytes of memory\n",
+               gs_ctx_matrix_size(&params));
         printf("*****************************\n");
 }
 
@@ -118,213 +267,646 @@ is_power_of_two(int val)
  * Write the matrix to a file.
  */
 static void
-write_matrix(FILE *file)
+write_matrix(const struct gs_context *ctx, FILE *file)
 {
-        gs_verbose_printf("\t****  Storing matrix to file  ****\n");
+        gs_verbose_printf(ctx, "\t****  Storing matrix to file  ****\n");
 
-        for (int j = 0; j < gs_size; j++) {
-                for (int i = 0; i < gs_size; i++)
+        for (int j = 0; j < ctx->params.size; j++) {
+                for (int i = 0; i < ctx->params.size; i++)
                         fprintf(file, "%g ",
-                                gs_matrix[GS_INDEX(i, j)]);
+                                ctx->matrix[GS_INDEX(ctx, i, j)]);
 
                 fprintf(file, "\n");  
         }
         fprintf(file, "\n");
 }
 
+/**
+ * Solve gs_batch copies of the problem with a backend, whole grids on
+ * each thread, and report the outcome of each of them. With -I, the
+ * threads solve interleaved groups of problems instead.
+ *
+ * \param converged Number of problems that converged
+ * \return Time taken by the solves
+ */
+static double
+run_batch(const struct gs_backend *backend, struct gs_pool *pool,
+          int *converged)
+{
+        struct gs_params batch_params = params;
+        struct gs_batch_result *results;
+        struct timespec ts;
+        double exec_time;
+
+        results = malloc(gs_batch * sizeof(*results));
+        if (!results) {
+                fprintf(stderr, "Failed to allocate batch results\n");
+                exit(EXIT_FAILURE);
+        }
+
+        batch_params.backend = backend->name;
+        /* The threads would interleave their per-iteration output */
+        batch_params.verbose = 0;
+
+        timing_start(&ts);
+        if (gs_interleave)
+                *converged = gs_batch_solve_interleaved(
+                        &batch_params, gs_batch, NULL, NULL,
+                        pool, params.nthreads, results);
+        else
+                *converged = gs_batch_solve(&batch_params, gs_batch, NULL,
+                                            NULL, pool, params.nthreads,
+                                            results);
+        exec_time = timing_stop(&ts);
+        if (*converged < 0)
+                exit(EXIT_FAILURE);
+
+        for (int k = 0; k < gs_batch; k++) {
+                if (results[k].converged)
+                        printf("Problem %d: Solution converged after %i "
+                               "iterations.\n", k, results[k].iterations);
+                else
+                        printf("Problem %d: Solution did NOT converge, "
+                               "error %f after %i iterations.\n", k,
+                               results[k].error, results[k].iterations);
+        }
+
+        free(results);
+        return exec_time;
+}
+
 /**
  * The "real" main function. This is called by main() after all
- * parameters have been handled.
+ * parameters have been handled. Every selected backend gets a context
+ * of its own, but they all run in turn on the same matrix and worker
+ * threads. The matrix is initialized again before each run.
+ *
+ * In batch mode every backend solves gs_batch problems instead, with a
+ * matrix per thread.
  */
 static void
 run_gs()
 {
         struct timespec ts;
         double exec_time;
+        size_t matrix_size = gs_ctx_matrix_size(&params);
+        struct gs_pool *pool;
+        struct gs_buffer matrix_buffer;
+
+        if (params.verbose)
+                printf("\t****  Initializing...  ****\n");
+
+        /* We are thread 0 of every gang the pool runs, and -F faults
+         * the matrix in on our node */
+        topology_bind_thread(0);
+
+        if (gs_buffer_alloc(&matrix_buffer, matrix_size, params.pages,
+                            params.populate) != 0) {
+                fprintf(stderr,
+                        "Error: Failed to allocate memory for matrix.\n");
+                exit(EXIT_FAILURE);
+        }
+        params.matrix = matrix_buffer.addr;
+        /* The pages asked for may not have been available */
+        if (params.verbose || params.pages != GS_PAGES_DEFAULT ||
+            params.populate)
+                printf("Matrix pages: %s%s\n",
+                       gs_pages_name(matrix_buffer.pages),
+                       matrix_buffer.populated ?
+                       ", pre-faulted" : "");
+
+        pool = gs_pool_create((selected_options & GS_OPT_THREADS) ?
+                              params.nthreads - 1 : 0);
+        if (!pool) {
+                fprintf(stderr, "Failed to start worker threads\n");
+                exit(EXIT_FAILURE);
+        }
 
-        gs_verbose_printf("\t****  Initializing...  ****\n");
+        for (int b = 0; b < nselected && gs_batch; b++) {
+                int converged;
 
-#if defined(__sun)
-        /* Sigh... posix_memalign isn't implemented in Solaris, so we
-         * have to use the legacy version instead. */
-        gs_matrix = (double *)memalign(
-            MATRIX_ALIGNMENT, gs_size * gs_width * sizeof(double));
-        if (!gs_matrix) {
-#else
-                if (posix_memalign((void **)&gs_matrix, MATRIX_ALIGNMENT,
-                           gs_size * gs_width * sizeof(double)) != 0) {
-#endif
+                exec_time = run_batch(selected[b], pool, &converged);
 
-                        fprintf(stderr,
-                                "Error: Failed to allocate memory for matrix.\n");
-                        exit(EXIT_FAILURE);
-                }
+                fprintf(stdout,"**** Summary ****\n");
+                fprintf(stdout,"   Backend: %s%s\n", selected[b]->name,
+                        gs_interleave ? " (interleaved)" : "");
+                fprintf(stdout,"   Execution time: %f s\n", exec_time);
+                fprintf(stdout,"   Problems converged: %d of %d\n",
+                        converged, gs_batch);
+                fprintf(stdout,"   Solves per second: %f\n",
+                        gs_batch / exec_time);
+                fprintf(stdout,"*****************\n");
+        }
 
-                init_matrix();
-                gsi_init();
+        for (int b = 0; b < nselected && !gs_batch; b++) {
+                struct gs_context *ctx;
+
+                params.backend = selected[b]->name;
+                ctx = gs_ctx_create(&params, pool);
+                if (!ctx)
+                        exit(EXIT_FAILURE);
+                if (params.verbose)
+                        topology_report_pages(ctx->matrix,
+                                              matrix_size);
 
-                gs_verbose_printf("\t****  Running GS...  ****\n");
+                gs_verbose_printf(ctx, "\t****  Running GS...  ****\n");
                 timing_start(&ts);
-                gsi_calculate();
+                gs_ctx_solve(ctx);
                 exec_time = timing_stop(&ts);
 
+                if (ctx->error <= params.tolerance) {
+                        printf("Solution converged after %i "
+                               "iterations.\n", ctx->iterations);
+                } else {
+                        printf("Reached maximum number of iterations. "
+                               "Solution did NOT converge.\n");
+                        printf("Note: This is normal if you are using "
+                               "the default settings.\n");
+                }
+
                 if (gs_output)
-                        write_matrix(gs_output);
+                        write_matrix(ctx, gs_output);
+
+                gs_verbose_printf(ctx, "\t****  Cleaning up...  ****\n");
+                gs_ctx_destroy(ctx);
 
-                gs_verbose_printf("\t****  Cleaning up...  ****\n");
-                gsi_finish();
-                free(gs_matrix);
-  
                 fprintf(stdout,"**** Summary ****\n");
+                fprintf(stdout,"   Backend: %s\n", selected[b]->name);
                 fprintf(stdout,"   Execution time: %f s\n", exec_time);
                 fprintf(stdout,"*****************\n");
         }
 
-        static void
-                usage(FILE *out, const char *argv0)
-        {
-                fprintf(out, "Usage: %s [OPTION]...\n"
-                        "\n"
-                        "Options:\n", argv0);
-
-                fprintf(out, "\t-v\t\tEnable verbose output\n");
-                fprintf(out, "\t-h\t\tDisplay usage\n");
-                fprintf(out,
-                        "\t-i ITER\t\tRun a maximum of ITER matrix sweeps. "
-                        "Default: %i\n",
-                        DEFAULT_ITERATIONS);
-                fprintf(out,
-                        "\t-e ERROR\tMaximum error tolerance. Default: %f\n",
-                        DEFAULT_TOLERANCE);
-                fprintf(out,
-                        "\t-s SIZE\t\tUse a matrix of SIZExSIZE elements. "
-                        "Default: %i\n", DEFAULT_SIZE);
-                fprintf(out, "\t-o FILE\t\tWrite result to FILE.\n");
-                fprintf(out,
-                        "\t-p PAD\t\tIntroduce padding of PAD elements. "
-                        "Default: %i\n", DEFAULT_PAD);
-
-                if (gsi_is_parallel)
-                        fprintf(out,
-                                "\t-t NUM\t\tStart NUM worker threads. Default: %i\n",
-                                DEFAULT_NTHREADS);
+        gs_pool_destroy(pool);
+        gs_buffer_free(&matrix_buffer);
+}
+
+static void
+usage(FILE *out, const char *argv0)
+{
+        fprintf(out, "Usage: %s [OPTION]...\n"
+                "\n"
+                "Options:\n", argv0);
+
+        fprintf(out, "\t-v\t\tEnable verbose output\n");
+        fprintf(out, "\t-h\t\tDisplay usage\n");
+        fprintf(out,
+                "\t-b NAME[,NAME]...\n"
+                "\t\t\tRun the backends NAME one after another "
+                "on the same\n"
+                "\t\t\tmatrix. Default: %s\n", DEFAULT_BACKEND);
+        for (int i = 0; gs_backend_get(i); i++)
+                fprintf(out, "\t\t\t  %-8s%s\n",
+                        gs_backend_get(i)->name,
+                        gs_backend_get(i)->description);
+        fprintf(out,
+                "\t-i ITER\t\tRun a maximum of ITER matrix sweeps. "
+                "Default: %i\n",
+                DEFAULT_ITERATIONS);
+        fprintf(out,
+                "\t-e ERROR\tMaximum error tolerance. Default: %f\n",
+                DEFAULT_TOLERANCE);
+        fprintf(out,
+                "\t-s SIZE\t\tUse a matrix of SIZExSIZE elements. "
+                "Default: %i\n", DEFAULT_SIZE);
+        fprintf(out, "\t-o FILE\t\tWrite result to FILE "
+                "(one backend only).\n");
+        fprintf(out,
+                "\t-B NUM\t\tSolve NUM independent problems, each "
+                "thread taking\n"
+                "\t\t\twhole problems one at a time. Default: "
+                "a single solve\n");
+        fprintf(out,
+                "\t-I\t\tSolve the problems of a batch %d at a "
+                "time per thread,\n"
+                "\t\t\tinterleaved in the lanes of the sweep "
+                "kernel (seq only)\n", GS_KERNEL_BATCH_LANES);
+        fprintf(out,
+                "\t-p PAD\t\tIntroduce padding of PAD elements, "
+                "or pick it from the\n"
+                "\t\t\tcache geometry with auto. Default: %i\n",
+                DEFAULT_PAD);
+        fprintf(out,
+                "\t-H PAGES\tBack the matrix with PAGES: default, "
+                "thp, 2m or 1g.\n"
+                "\t\t\tFalls back to smaller pages if they "
+                "aren't available.\n"
+                "\t\t\tDefault: %s\n",
+                gs_pages_name(DEFAULT_PAGES));
+        fprintf(out,
+                "\t-F\t\tFault in the pages of the matrix when "
+                "it is allocated,\n"
+                "\t\t\tall on the node of the main thread\n");
+        fprintf(out,
+                "\t-k KERNEL\tSweep kernel: auto, scalar, sse2, avx2 "
+                "or avx512. Default: %s\n", DEFAULT_KERNEL);
+        fprintf(out, "\t-K\t\tList the kernels this CPU supports\n");
+
+        fprintf(out, "\nBackend specific options:\n");
+        fprintf(out,
+                "\t-P COLS\t\tSweep in panels of COLS columns, or fit "
+                "them in cache with\n"
+                "\t\t\tauto. Default: whole rows\n\t\t\t");
+        print_option_backends(out, GS_OPT_PANELS);
+        fprintf(out,
+                "\t-T DEPTH\tFuse DEPTH sweeps into one pass "
+                "over the matrix. Default: %i\n\t\t\t",
+                DEFAULT_TEMPORAL_DEPTH);
+        print_option_backends(out, GS_OPT_FUSE);
+        fprintf(out,
+                "\t-t NUM\t\tStart NUM worker threads. "
+                "Default: one per available CPU (%i)\n\t\t\t",
+                params.nthreads);
+        print_option_backends(out, GS_OPT_THREADS);
+        fprintf(out,
+                "\t-a BIND\t\tBind threads to CPUs, BIND is "
+                "none, compact, scatter or a\n"
+                "\t\t\tlist of CPUs such as 0,2,8-11. "
+                "Default: none\n\t\t\t");
+        print_option_backends(out, GS_OPT_THREADS);
+        fprintf(out,
+                "\t-r ROWS\t\tUse tiles of ROWS rows. "
+                "Default: fit the tile in cache\n");
+        fprintf(out,
+                "\t-c COLS\t\tUse tiles of COLS columns. "
+                "Default: one strip per thread\n\t\t\t");
+        print_option_backends(out, GS_OPT_TILES);
+        fprintf(out,
+                "\t-W POLICY\tWait for other threads using "
+                "POLICY (spin, backoff or futex). "
+                "Default: %s\n\t\t\t",
+                wait_policy_names[DEFAULT_WAIT_POLICY]);
+        print_option_backends(out, GS_OPT_WAIT);
+        fprintf(out,
+                "\t-w OMEGA\tOver-relax the sweeps by OMEGA, "
+                "between 0 and 2, or auto to\n"
+                "\t\t\testimate it from the decay of the error. "
+                "Default: %f\n\t\t\t", DEFAULT_OMEGA);
+        print_option_backends(out, GS_OPT_OMEGA);
+        fprintf(out,
+                "\t-m CYCLE\tMultigrid cycle, v, w or fmg. "
+                "Every cycle counts as an\n"
+                "\t\t\titeration. Default: %s\n\t\t\t",
+                cycle_names[DEFAULT_CYCLE]);
+        print_option_backends(out, GS_OPT_CYCLE);
+        fprintf(out,
+                "\t-L LAYOUT\tStore the matrix in LAYOUT, tiles "
+                "are %dx%d elements.\n"
+                "\t\t\tDefault: %s\n", GS_TILE_SIZE, GS_TILE_SIZE,
+                layout_names[DEFAULT_LAYOUT]);
+        for (int k = 0; k <= GS_LAYOUT_REDBLACK; k++) {
+                fprintf(out, "\t\t\t  %-10s%s ", layout_names[k],
+                        layout_descriptions[k]);
+                if (k == GS_LAYOUT_ROWS)
+                        fprintf(out, "(all)\n");
+                else
+                        print_layout_backends(out, k);
         }
+}
 
-        int
-                main(int argc, char *argv[])
-        {
-                int c;
-                int errexit = 0;
-                extern char *optarg;
-                extern int optind, optopt, opterr;
-
-                while ((c = getopt(argc, argv, "vhi:e:s:t:p:o:")) != -1) {
-                        switch (c) {
-                        case 'v':
-                                gs_verbose = 1; 
-                                break;
+int
+main(int argc, char *argv[])
+{
+        int c;
+        int errexit = 0;
+        int pad_auto = 0;
+        unsigned used = 0;
+        extern char *optarg;
+        extern int optind, optopt, opterr;
+        int ncpus = topology_default_nthreads();
+
+        if (ncpus > 0)
+                params.nthreads = ncpus;
+        gs_kernel_select(DEFAULT_KERNEL);
+        select_backends(DEFAULT_BACKEND);
+
+        while ((c = getopt(argc, argv, "vhb:B:Ii:e:w:m:s:t:p:o:r:c:W:a:k:KT:P:H:FL:")) != -1) {
+                switch (c) {
+                case 'v':
+                        params.verbose = 1; 
+                        break;
+
+                case 'b':
+                        if (select_backends(optarg) != 0)
+                                errexit = 1;
+                        break;
 
-                        case 'i':
-                                gs_iterations = atoi(optarg);
-                                if (gs_iterations <= 0) {
-                                        fprintf(stderr,
-                                                "Number of iterations must be "
-                                                "strictly greater than 1.\n");
-                                        errexit = 1;
-                                }
-                                break;
+                case 'B':
+                        gs_batch = atoi(optarg);
+                        if (gs_batch <= 0) {
+                                fprintf(stderr,
+                                        "Number of problems must be "
+                                        "positive.\n");
+                                errexit = 1;
+                        }
+                        break;
 
-                        case 'e':
-                                gs_tolerance = atof(optarg);
-                                break;
+                case 'I':
+                        gs_interleave = 1;
+                        break;
 
-                        case 's':
-                                gs_size = atoi(optarg);
-                                if (gs_size <= 0) {
-                                        fprintf(stderr,
-                                                "Size must be larger than 1.\n");
-                                        errexit = 1;
-                                } else if (!is_power_of_two(gs_size)) {
-                                        fprintf(stderr,
-                                                "Size is not a power of two.\n");
-                                        errexit = 1;
-                                }
-                                break;
+                case 'i':
+                        params.iterations = atoi(optarg);
+                        if (params.iterations <= 0) {
+                                fprintf(stderr,
+                                        "Number of iterations must be "
+                                        "strictly greater than 1.\n");
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'e':
+                        params.tolerance = atof(optarg);
+                        break;
+
+                case 'w':
+                        if (!strcmp(optarg, "auto"))
+                                params.omega = GS_OMEGA_AUTO;
+                        else
+                                params.omega = atof(optarg);
+                        used |= GS_OPT_OMEGA;
+                        if (params.omega != GS_OMEGA_AUTO &&
+                            !(params.omega > 0.0 &&
+                              params.omega < 2.0)) {
+                                fprintf(stderr,
+                                        "Over-relaxation factor "
+                                        "must be between 0 and 2.\n");
+                                errexit = 1;
+                        }
+                        break;
 
-                        case 't':
-                                gs_nthreads = atoi(optarg);
-                                if (!gsi_is_parallel) {
-                                        fprintf(stderr,
-                                                "This is the sequential version "
-                                                "-- -t doesn't make sense!\n");
-                                        errexit = 1;
-                                } else if (gs_nthreads <= 0) {
-                                        fprintf(stderr,
-                                                "Number of threads must be "
-                                                "positive.\n");
-                                        errexit = 1;
-                                } else if (!is_power_of_two(gs_nthreads)) {
-                                        fprintf(stderr,
-                                                "Number is not a power of two.\n");
-                                        errexit = 1;
-                                }
-                                break;
+                case 'm':
+                        params.cycle = -1;
+                        for (int k = 0; k <= GS_CYCLE_FMG; k++) {
+                                if (!strcmp(optarg, cycle_names[k]))
+                                        params.cycle = k;
+                        }
+                        used |= GS_OPT_CYCLE;
+                        if (params.cycle < 0) {
+                                fprintf(stderr,
+                                        "Unknown multigrid cycle: %s\n",
+                                        optarg);
+                                errexit = 1;
+                        }
+                        break;
 
-                        case 'p':
-                                gs_pad = atoi(optarg);
-                                if (gs_pad < 0) {
-                                        fprintf(stderr,
-                                                "Padding must be greater or equal "
-                                                "to 0.\n");
-                                        errexit = 1;
-                                }
-                                break;
+                case 'L':
+                        params.layout = -1;
+                        for (int k = 0; k <= GS_LAYOUT_REDBLACK; k++) {
+                                if (!strcmp(optarg, layout_names[k]))
+                                        params.layout = k;
+                        }
+                        if (params.layout < 0) {
+                                fprintf(stderr,
+                                        "Unknown layout: %s\n",
+                                        optarg);
+                                errexit = 1;
+                        }
+                        break;
 
-                        case 'o':
-                                gs_output = fopen(optarg, "w");
-                                if (!gs_output) {
-                                        perror("Failed to open output");
-                                        errexit = 1;
-                                }
-                                break;
+                case 's':
+                        params.size = atoi(optarg);
+                        if (params.size <= 0) {
+                                fprintf(stderr,
+                                        "Size must be larger than 1.\n");
+                                errexit = 1;
+                        } else if (!is_power_of_two(params.size)) {
+                                fprintf(stderr,
+                                        "Size is not a power of two.\n");
+                                errexit = 1;
+                        }
+                        break;
 
-                        case 'h':
-                                usage(stdout, argv[0]);
-                                exit(EXIT_SUCCESS);
+                case 't':
+                        params.nthreads = atoi(optarg);
+                        used |= GS_OPT_THREADS;
+                        if (params.nthreads <= 0) {
+                                fprintf(stderr,
+                                        "Number of threads must be "
+                                        "positive.\n");
+                                errexit = 1;
+                        }
+                        break;
 
-                        case ':':
+                case 'a':
+                        used |= GS_OPT_THREADS;
+                        if (topology_set_binding(optarg) != 0) {
                                 fprintf(stderr,
-                                        "%s: option -%c requries an operand\n",
-                                        argv[0], optopt);
+                                        "Invalid or unsupported thread "
+                                        "binding: %s\n", optarg);
                                 errexit = 1;
-                                break;
-                        case '?':
+                        }
+                        break;
+
+                case 'r':
+                case 'c':
+                        used |= GS_OPT_TILES;
+                        if (atoi(optarg) <= 0) {
                                 fprintf(stderr,
-                                        "%s: illegal option -- %c\n",
-                                        argv[0], optopt);
+                                        "Tile size must be positive.\n");
                                 errexit = 1;
+                        } else if (c == 'r') {
+                                params.tile_rows = atoi(optarg);
+                        } else {
+                                params.tile_cols = atoi(optarg);
+                        }
+                        break;
+
+                case 'W':
+                        params.wait_policy = -1;
+                        for (int k = 0; k <= GS_WAIT_FUTEX; k++) {
+                                if (!strcmp(optarg, wait_policy_names[k]))
+                                        params.wait_policy = k;
+                        }
+                        used |= GS_OPT_WAIT;
+                        if (params.wait_policy < 0) {
+                                fprintf(stderr,
+                                        "Unknown wait policy: %s\n",
+                                        optarg);
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'p':
+                        pad_auto = !strcmp(optarg, "auto");
+                        params.pad = pad_auto ? 0 : atoi(optarg);
+                        if (params.pad < 0) {
+                                fprintf(stderr,
+                                        "Padding must be greater or equal "
+                                        "to 0.\n");
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'T':
+                        params.temporal_depth = atoi(optarg);
+                        used |= GS_OPT_FUSE;
+                        if (params.temporal_depth <= 0) {
+                                fprintf(stderr,
+                                        "Depth must be positive.\n");
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'P':
+                        used |= GS_OPT_PANELS;
+                        if (!strcmp(optarg, "auto")) {
+                                params.panel_cols = GS_PANELS_AUTO;
                                 break;
-                        default:
-                                abort();
                         }
-                }
+                        params.panel_cols = atoi(optarg);
+                        if (params.panel_cols <= 0) {
+                                fprintf(stderr,
+                                        "Panel width must be "
+                                        "positive.\n");
+                                errexit = 1;
+                        }
+                        break;
 
-                if (errexit) {
-                        usage(stderr, argv[0]);
-                        exit(EXIT_FAILURE);
+                case 'H':
+                        params.pages = gs_pages_find(optarg);
+                        if (params.pages < 0) {
+                                fprintf(stderr,
+                                        "Unknown page size: %s\n",
+                                        optarg);
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'F':
+                        params.populate = 1;
+                        break;
+
+                case 'k':
+                        if (gs_kernel_select(optarg) != 0) {
+                                fprintf(stderr,
+                                        "Unknown kernel or kernel not "
+                                        "supported by this CPU: %s\n",
+                                        optarg);
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'K':
+                        for (int i = 0; gs_kernel_get(i); i++)
+                                printf("%s\n", gs_kernel_get(i));
+                        exit(EXIT_SUCCESS);
+
+                case 'o':
+                        gs_output = fopen(optarg, "w");
+                        if (!gs_output) {
+                                perror("Failed to open output");
+                                errexit = 1;
+                        }
+                        break;
+
+                case 'h':
+                        usage(stdout, argv[0]);
+                        exit(EXIT_SUCCESS);
+
+                case ':':
+                        fprintf(stderr,
+                                "%s: option -%c requries an operand\n",
+                                argv[0], optopt);
+                        errexit = 1;
+                        break;
+                case '?':
+                        fprintf(stderr,
+                                "%s: illegal option -- %c\n",
+                                argv[0], optopt);
+                        errexit = 1;
+                        break;
+                default:
+                        abort();
                 }
+        }
 
-                gs_width = gs_size + gs_pad;
-  
-                /* At this point all the options have been processed. */
-                if (gs_verbose)
-                        print_info();
+        /* A batch runs its problems on -t threads, whatever the
+         * backend */
+        if (gs_batch)
+                selected_options |= GS_OPT_THREADS;
+
+        /* Options are only checked against the backends once
+         * all of them are known, -b may come last. When several
+         * backends are compared, an option applies to those
+         * that understand it. */
+        for (size_t k = 0;
+             k < sizeof(option_flags) / sizeof(*option_flags); k++) {
+                if ((used & option_flags[k].option) &&
+                    !(selected_options & option_flags[k].option)) {
+                        fprintf(stderr,
+                                "%s doesn't make sense with the "
+                                "selected backend.\n",
+                                option_flags[k].flags);
+                        errexit = 1;
+                }
+        }
+        if (gs_output && nselected > 1) {
+                fprintf(stderr,
+                        "-o can only be used with one backend.\n");
+                errexit = 1;
+        }
+        if (gs_output && gs_batch) {
+                fprintf(stderr,
+                        "-o can't be used in batch mode.\n");
+                errexit = 1;
+        }
+        /* The interleaved sweep is the plain lexicographic one
+         * of seq */
+        if (gs_interleave &&
+            (!gs_batch || nselected != 1 ||
+             strcmp(selected[0]->name, "seq") ||
+             (used & (GS_OPT_FUSE | GS_OPT_PANELS)) ||
+             params.omega != 1.0)) {
+                fprintf(stderr,
+                        "-I needs -B and the seq backend, without "
+                        "-T, -P or -w.\n");
+                errexit = 1;
+        }
+        if (params.layout > GS_LAYOUT_ROWS &&
+            !(selected_layouts & 1u << params.layout)) {
+                fprintf(stderr,
+                        "-L %s doesn't make sense with the selected "
+                        "backend.\n", layout_names[params.layout]);
+                errexit = 1;
+        }
+        /* Tiles take the place of strips and panels */
+        if ((params.layout == GS_LAYOUT_TILES ||
+             params.layout == GS_LAYOUT_MORTON) &&
+            ((used & (GS_OPT_FUSE | GS_OPT_PANELS)) || gs_interleave)) {
+                fprintf(stderr,
+                        "-L %s can't be combined with -T, -P or -I.\n",
+                        layout_names[params.layout]);
+                errexit = 1;
+        }
+        if (params.layout > GS_LAYOUT_ROWS && (params.pad || pad_auto)) {
+                fprintf(stderr,
+                        "-L %s can't be combined with -p.\n",
+                        layout_names[params.layout]);
+                errexit = 1;
+        }
 
-                run_gs();
+        if (errexit) {
+                usage(stderr, argv[0]);
+                exit(EXIT_FAILURE);
+        }
 
-                return EXIT_SUCCESS;
+        /* The padding depends on the size and the pages, which may
+         * come after -p */
+        if (pad_auto) {
+                params.pad = gs_kernel_padding(params.size,
+                                               gs_pages_size(params.pages));
+                printf("Padding: %d elements (auto)\n", params.pad);
         }
 
+        /* At this point all the options have been processed. */
+        if (params.verbose)
+                print_info();
+
+        run_gs();
+
+        return EXIT_SUCCESS;
+}
+
 /*
  * Local Variables:
  * mode: c
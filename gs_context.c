@@ -0,0 +1,530 @@
+/**
+ * Solver contexts and the backend registry.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <limits.h>
+
+#include "gs_interface.h"
+#include "gs_kernel.h"
+
+/* Maximum number of backends that can be registered */
+#define MAX_BACKENDS                 16
+
+/* Registered backends, sorted by name */
+static const struct gs_backend *backends[MAX_BACKENDS];
+static int nbackends = 0;
+
+void
+gs_register_backend(const struct gs_backend *backend)
+{
+        int i;
+
+        if (nbackends == MAX_BACKENDS) {
+                fprintf(stderr, "Too many backends, can't register %s\n",
+                        backend->name);
+                exit(EXIT_FAILURE);
+        }
+
+        /* Constructors run in link order, keep the list sorted */
+        for (i = nbackends; i > 0 &&
+                     strcmp(backends[i - 1]->name, backend->name) > 0; i--)
+                backends[i] = backends[i - 1];
+        backends[i] = backend;
+        nbackends++;
+}
+
+const struct gs_backend *
+gs_backend_get(int index)
+{
+        return index >= 0 && index < nbackends ? backends[index] : NULL;
+}
+
+const struct gs_backend *
+gs_backend_find(const char *name)
+{
+        for (int i = 0; i < nbackends; i++) {
+                if (!strcmp(backends[i]->name, name))
+                        return backends[i];
+        }
+
+        return NULL;
+}
+
+void
+gs_verbose_printf(const struct gs_context *ctx, const char *fmt, ...)
+{
+        va_list ap;
+        va_start(ap, fmt);
+
+        if (ctx->params.verbose)
+                vprintf(fmt, ap);
+
+        va_end(ap);
+}
+
+void
+gs_ctx_reset(struct gs_context *ctx)
+{
+        const int size = ctx->params.size;
+        const double sqrt3 = 1.73205080757;
+        const double size_inv = 1.0 / (size - 1);
+
+        gs_verbose_printf(ctx, "\t****  Initializing the matrix  ****\n");
+
+        for (int i = 0; i < size; i++) {
+                for(int j = 0; j < size; j++)
+                        ctx->matrix[GS_INDEX(ctx, i, j)] =
+                                sin(M_PI * i * size_inv) *
+                                sin(M_PI * j * size_inv) *
+                                sin(M_PI * M_SQRT2 * i * size_inv) *
+                                sin(M_PI * sqrt3 * j * size_inv);
+        }
+}
+
+size_t
+gs_ctx_matrix_size(const struct gs_params *params)
+{
+        int tiles = (params->size + GS_TILE_SIZE - 1) / GS_TILE_SIZE;
+
+        switch (params->layout) {
+        case GS_LAYOUT_MORTON:
+                /* The Z-order of a square of tiles a power of two a
+                 * side has no holes */
+                while (tiles & (tiles - 1))
+                        tiles += tiles & -tiles;
+                /* Fall through */
+        case GS_LAYOUT_TILES:
+                return (size_t)tiles * tiles * GS_TILE_SIZE * GS_TILE_SIZE *
+                        sizeof(double);
+        case GS_LAYOUT_REDBLACK:
+                return 2 * (size_t)params->size * ((params->size + 1) / 2) *
+                        sizeof(double);
+        default:
+                return (size_t)params->size * (params->size + params->pad) *
+                        sizeof(double);
+        }
+}
+
+struct gs_context *
+gs_ctx_create(const struct gs_params *params, struct gs_pool *pool)
+{
+        const struct gs_backend *backend = gs_backend_find(params->backend);
+        struct gs_context *ctx;
+        int nthreads = MAX(params->nthreads, 1);
+
+        if (!backend) {
+                fprintf(stderr, "Unknown backend: %s\n", params->backend);
+                return NULL;
+        }
+        if (params->size <= 0 || params->pad < 0) {
+                fprintf(stderr, "Invalid matrix size.\n");
+                return NULL;
+        }
+        if (params->omega != GS_OMEGA_AUTO &&
+            !(params->omega > 0.0 && params->omega < 2.0)) {
+                fprintf(stderr, "Over-relaxation factor must be in (0, 2).\n");
+                return NULL;
+        }
+        if (params->layout != GS_LAYOUT_ROWS && params->pad &&
+            (backend->layouts & 1u << params->layout)) {
+                fprintf(stderr, "Only rows can be padded.\n");
+                return NULL;
+        }
+        if (!(backend->options & GS_OPT_THREADS))
+                nthreads = 1;
+        if (pool && nthreads > gs_pool_size(pool)) {
+                fprintf(stderr, "Can't run %d threads on a pool of %d.\n",
+                        nthreads, gs_pool_size(pool));
+                return NULL;
+        }
+
+        ctx = calloc(1, sizeof(*ctx));
+        if (!ctx) {
+                fprintf(stderr, "Failed to allocate solver context\n");
+                return NULL;
+        }
+        ctx->params = *params;
+        ctx->params.nthreads = nthreads;
+        if (!(backend->options & GS_OPT_OMEGA))
+                ctx->params.omega = 1.0;
+        if (!(backend->layouts & 1u << params->layout))
+                ctx->params.layout = GS_LAYOUT_ROWS;
+        ctx->width = params->size + params->pad;
+        ctx->tiles = (params->size + GS_TILE_SIZE - 1) / GS_TILE_SIZE;
+        ctx->split_width = (params->size + 1) / 2;
+        ctx->backend = backend;
+
+        ctx->matrix = params->matrix;
+        if (!ctx->matrix) {
+                if (gs_buffer_alloc(&ctx->matrix_buffer,
+                                    gs_ctx_matrix_size(&ctx->params),
+                                    params->pages,
+                                    params->populate) != 0) {
+                        fprintf(stderr,
+                                "Error: Failed to allocate memory for matrix.\n");
+                        free(ctx);
+                        return NULL;
+                }
+                ctx->matrix = ctx->matrix_buffer.addr;
+                ctx->owns_matrix = 1;
+        }
+
+        ctx->pool = pool;
+        if (!pool && nthreads > 1) {
+                ctx->pool = gs_pool_create(nthreads - 1);
+                if (!ctx->pool) {
+                        fprintf(stderr, "Failed to start worker threads\n");
+                        if (ctx->owns_matrix)
+                                gs_buffer_free(&ctx->matrix_buffer);
+                        free(ctx);
+                        return NULL;
+                }
+                ctx->owns_pool = 1;
+        }
+
+        /* The backend gets to touch the matrix first, so that its pages
+         * end up close to the threads using them */
+        backend->init(ctx);
+        gs_ctx_reset(ctx);
+
+        return ctx;
+}
+
+double
+gs_ctx_omega(const struct gs_context *ctx)
+{
+        return ctx->omega;
+}
+
+/* Estimates are rounded down to multiples of 1 / OMEGA_STEPS. Every
+ * backend observes the complete error of the sweeps gs_ctx_omega_wants()
+ * names, but may sum it up in its own order. The rounding drops the last
+ * bits in which those sums differ, unless an estimate lands right on a
+ * step. */
+#define OMEGA_STEPS 1048576.0
+
+/**
+ * Get the length of the trial periods. Error modes take longer to
+ * settle after omega changed on larger grids.
+ */
+static int
+omega_period(const struct gs_context *ctx)
+{
+        return MAX(GS_OMEGA_TRIAL_SWEEPS, ctx->params.size / 4);
+}
+
+int
+gs_ctx_omega_sweeps(const struct gs_context *ctx, int iteration)
+{
+        if (ctx->params.omega != GS_OMEGA_AUTO || ctx->omega_settled)
+                return INT_MAX;
+
+        return omega_period(ctx) - iteration % omega_period(ctx);
+}
+
+/* The decay of the errors is measured over the second half of every
+ * trial period, leaving the first half to settle after omega changed */
+int
+gs_ctx_omega_wants(const struct gs_context *ctx, int iteration)
+{
+        const int period = omega_period(ctx);
+        const int k = iteration % period;
+
+        return ctx->params.omega == GS_OMEGA_AUTO && !ctx->omega_settled &&
+                (k == period / 2 || k == period - 1);
+}
+
+void
+gs_ctx_omega_observe(struct gs_context *ctx, int iteration, double error)
+{
+        const int period = omega_period(ctx);
+        const double omega = ctx->omega;
+        double lambda, mu2;
+
+        if (!gs_ctx_omega_wants(ctx, iteration))
+                return;
+        if (iteration % period == period / 2) {
+                ctx->omega_trial_error = error;
+                return;
+        }
+
+        /* Decay per sweep and the radius of the Jacobi iteration it
+         * implies, assuming omega is still below the optimum */
+        lambda = pow(error / ctx->omega_trial_error,
+                     1.0 / (period - 1 - period / 2));
+        mu2 = (lambda + omega - 1) * (lambda + omega - 1) /
+                (lambda * omega * omega);
+
+        /* The errors may grow for a while after omega changed, try
+         * again in the next period. At the optimum the decay drops to
+         * about omega - 1, and past it the estimate falls apart. Keep
+         * omega for the rest of the solve once we are close. */
+        if (lambda < 1.0 && mu2 < 1.0) {
+                if (lambda > pow(omega - 1, 0.75))
+                        ctx->omega = MAX(omega,
+                                         floor(OMEGA_STEPS * 2.0 /
+                                               (1.0 + sqrt(1.0 - mu2))) /
+                                         OMEGA_STEPS);
+                else
+                        ctx->omega_settled = 1;
+        }
+        gs_verbose_printf(ctx, "Error decay per sweep: %f, omega: %f\n",
+                          lambda, ctx->omega);
+}
+
+int
+gs_ctx_solve(struct gs_context *ctx)
+{
+        ctx->iterations = 0;
+        ctx->error = ctx->params.tolerance + 1;
+        ctx->omega = ctx->params.omega == GS_OMEGA_AUTO ?
+                1.0 : ctx->params.omega;
+        ctx->omega_settled = 0;
+        ctx->backend->calculate(ctx);
+
+        return ctx->error <= ctx->params.tolerance;
+}
+
+void
+gs_ctx_destroy(struct gs_context *ctx)
+{
+        if (!ctx)
+                return;
+
+        ctx->backend->finish(ctx);
+        if (ctx->owns_pool)
+                gs_pool_destroy(ctx->pool);
+        if (ctx->owns_matrix)
+                gs_buffer_free(&ctx->matrix_buffer);
+        free(ctx);
+}
+
+/** A batch handed out to the threads of gs_batch_solve() */
+struct batch {
+        const struct gs_params *params;
+        int nproblems;
+        void (*fill)(struct gs_context *, int, void *);
+        void *arg;
+        struct gs_batch_result *results;
+        atomic_int next;        /* Next problem to hand out */
+        atomic_int failed;      /* Set if a thread couldn't get a context */
+};
+
+static void
+batch_worker(void *_batch, int id)
+{
+        struct batch *batch = _batch;
+        struct gs_params params = *batch->params;
+        struct gs_context *ctx;
+        int fresh = 1;          /* Matrix holds the initial values */
+        int k;
+
+        (void)id;
+
+        /* The context is created on this thread, so its pages are
+         * local to it */
+        params.nthreads = 1;
+        params.matrix = NULL;
+        ctx = gs_ctx_create(&params, NULL);
+        if (!ctx) {
+                atomic_store(&batch->failed, 1);
+                return;
+        }
+
+        while ((k = atomic_fetch_add(&batch->next, 1)) < batch->nproblems) {
+                struct gs_batch_result *result = &batch->results[k];
+
+                if (batch->fill)
+                        batch->fill(ctx, k, batch->arg);
+                else if (!fresh)
+                        gs_ctx_reset(ctx);
+                fresh = 0;
+
+                result->converged = gs_ctx_solve(ctx);
+                result->iterations = ctx->iterations;
+                result->error = ctx->error;
+        }
+
+        gs_ctx_destroy(ctx);
+}
+
+int
+gs_batch_solve(const struct gs_params *params, int nproblems,
+               void (*fill)(struct gs_context *ctx, int problem, void *arg),
+               void *arg, struct gs_pool *pool, int nthreads,
+               struct gs_batch_result *results)
+{
+        struct batch batch = {
+                .params = params,
+                .nproblems = nproblems,
+                .fill = fill,
+                .arg = arg,
+                .results = results,
+        };
+        int converged = 0;
+
+        atomic_init(&batch.next, 0);
+        atomic_init(&batch.failed, 0);
+
+        /* No point in threads without a problem to solve */
+        nthreads = MAX(MIN(nthreads, nproblems), 1);
+        gs_pool_run(pool, nthreads, batch_worker, &batch);
+
+        if (atomic_load(&batch.failed))
+                return -1;
+        for (int k = 0; k < nproblems; k++)
+                converged += results[k].converged;
+
+        return converged;
+}
+
+/**
+ * Solve the problems of a batch GS_KERNEL_BATCH_LANES at a time. The
+ * batch hands out groups of problems rather than single ones.
+ */
+static void
+interleaved_worker(void *_batch, int id)
+{
+        struct batch *batch = _batch;
+        struct gs_params params = *batch->params;
+        const int lanes = GS_KERNEL_BATCH_LANES;
+        const int size = params.size;
+        const double tolerance = params.tolerance;
+        struct gs_context *ctx;
+        double *grid;
+        int fresh = 1;
+        int group;
+
+        (void)id;
+
+        /* The problems are set up in a context of their own and then
+         * copied into their lane */
+        params.nthreads = 1;
+        params.matrix = NULL;
+        ctx = gs_ctx_create(&params, NULL);
+        if (!ctx) {
+                atomic_store(&batch->failed, 1);
+                return;
+        }
+        grid = aligned_alloc(64, (size_t)size * ctx->width * lanes *
+                             sizeof(double));
+        if (!grid) {
+                fprintf(stderr, "Failed to allocate interleaved matrix\n");
+                atomic_store(&batch->failed, 1);
+                gs_ctx_destroy(ctx);
+                return;
+        }
+
+        while ((group = atomic_fetch_add(&batch->next, 1)) <
+               (batch->nproblems + lanes - 1) / lanes) {
+                struct gs_batch_result *results =
+                        &batch->results[group * lanes];
+                const int n = MIN(lanes, batch->nproblems - group * lanes);
+                int active[GS_KERNEL_BATCH_LANES] = { 0 };
+                int nactive = n;
+
+                for (int p = 0; p < n; p++) {
+                        if (batch->fill)
+                                batch->fill(ctx, group * lanes + p,
+                                            batch->arg);
+                        else if (!fresh)
+                                gs_ctx_reset(ctx);
+                        fresh = 0;
+
+                        /* The grid is row-major whatever the layout of
+                         * the context is */
+                        for (int i = 0; i < size; i++) {
+                                for (int j = 0; j < size; j++)
+                                        grid[((size_t)ctx->width * i + j) *
+                                             lanes + p] =
+                                                ctx->matrix[GS_INDEX(ctx, i, j)];
+                        }
+
+                        active[p] = 1;
+                        results[p].iterations = 0;
+                        results[p].error = tolerance + 1;
+                }
+
+                /* Same loop as gs_ctx_solve(), but a problem drops out
+                 * on its own once it has converged */
+                for (int i = 0; i < params.iterations && nactive; i++) {
+                        double error[GS_KERNEL_BATCH_LANES] = { 0.0 };
+
+                        gs_kernel_sweep_interleaved(grid, ctx->width,
+                                                    1, size - 1, 1, size - 1,
+                                                    active, error);
+                        for (int p = 0; p < n; p++) {
+                                if (!active[p])
+                                        continue;
+                                results[p].iterations = i + 1;
+                                results[p].error = error[p];
+                                if (!(error[p] > tolerance)) {
+                                        active[p] = 0;
+                                        nactive--;
+                                }
+                        }
+                }
+
+                for (int p = 0; p < n; p++)
+                        results[p].converged = results[p].error <= tolerance;
+        }
+
+        free(grid);
+        gs_ctx_destroy(ctx);
+}
+
+int
+gs_batch_solve_interleaved(const struct gs_params *params, int nproblems,
+                           void (*fill)(struct gs_context *ctx, int problem,
+                                        void *arg),
+                           void *arg, struct gs_pool *pool, int nthreads,
+                           struct gs_batch_result *results)
+{
+        struct batch batch = {
+                .params = params,
+                .nproblems = nproblems,
+                .fill = fill,
+                .arg = arg,
+                .results = results,
+        };
+        const int ngroups = (nproblems + GS_KERNEL_BATCH_LANES - 1) /
+                GS_KERNEL_BATCH_LANES;
+        int converged = 0;
+
+        if (params->omega != 1.0) {
+                fprintf(stderr, "Interleaved batches can't over-relax.\n");
+                return -1;
+        }
+
+        atomic_init(&batch.next, 0);
+        atomic_init(&batch.failed, 0);
+
+        nthreads = MAX(MIN(nthreads, ngroups), 1);
+        gs_pool_run(pool, nthreads, interleaved_worker, &batch);
+
+        if (atomic_load(&batch.failed))
+                return -1;
+        for (int k = 0; k < nproblems; k++)
+                converged += results[k].converged;
+
+        return converged;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -2,10 +2,14 @@
  * Declarations of the interface used to execute an implementation of
  * the Gauss Seidel algorithm
  *
- * The gs_* symbols are exported TO the implementation and are runtime
- * parameters or helper functions.
+ * A solve is described by a struct gs_context, which owns the grid, the
+ * parameters and the state of the backend running it. Contexts don't
+ * share anything but the worker threads of a struct gs_pool, so several
+ * solves can run at the same time in one process.
  *
- * The gsi_* symbols must be exported BY the GS implementation.
+ * Every implementation (backend) fills in a struct gs_backend and
+ * registers it with GS_REGISTER_BACKEND(). The backend to run is then
+ * picked by name.
  *
  * Course: Advanced Computer Architecture, Uppsala University
  * Course Part: Lab assignment 3
@@ -17,53 +21,413 @@
 #ifndef GS_INTERFACE_H
 #define GS_INTERFACE_H
 
-/** 1 if command line options for parallel execution should be enabled. */
-extern const int gsi_is_parallel;
+#include "gs_pool.h"
+#include "gs_alloc.h"
+#include "gs_kernel.h"
+
+/** How worker threads wait for each other */
+enum gs_wait_policy {
+        /** Busy wait, issuing PAUSE between polls */
+        GS_WAIT_SPIN,
+        /** Busy wait with exponential backoff, yielding once saturated */
+        GS_WAIT_BACKOFF,
+        /** Spin briefly, then sleep on a futex until woken by the producer */
+        GS_WAIT_FUTEX,
+};
+
+/** Cycles of the multigrid backend */
+enum gs_cycle {
+        /** One correction per coarse grid */
+        GS_CYCLE_V,
+        /** Two corrections per coarse grid, each one a W-cycle again */
+        GS_CYCLE_W,
+        /** Full multigrid from the coarsest grid up, then V-cycles */
+        GS_CYCLE_FMG,
+};
+
+/** Storage layouts of the matrix */
+enum gs_layout {
+        /** Row after row, width elements apart */
+        GS_LAYOUT_ROWS,
+        /** Square tiles of GS_TILE_SIZE elements a side, each stored row
+         * by row, and the tiles in the same order */
+        GS_LAYOUT_TILES,
+        /** The same tiles in Z-order (Morton order), so that the tiles
+         * above and below one are mostly close to it as well */
+        GS_LAYOUT_MORTON,
+        /** The points of each colour of the red-black ordering row by
+         * row in an array of their own, see gs_colour_base() */
+        GS_LAYOUT_REDBLACK,
+};
+
+/** Side of the tiles of the tiled layouts, in elements */
+#define GS_TILE_SIZE 128
+
+/** Runtime parameters of a solve */
+struct gs_params {
+        /** name of the backend to run */
+        const char *backend;
+        /** 1 if verbose output is enabled */
+        int verbose;
+        /** size of matrix (excluding padding) */
+        int size;
+        /** number elements of padding on the sides of the matrix */
+        int pad;
+        /** number of iterations to run */
+        int iterations;
+        /** maximum error for convergence */
+        double tolerance;
+        /** number of threads to use, 0 for one */
+        int nthreads;
+        /** tile height for the parallel wavefront, 0 to pick automatically */
+        int tile_rows;
+        /** tile width for the parallel wavefront, 0 to pick automatically */
+        int tile_cols;
+        /** wait policy for the parallel implementation, see enum gs_wait_policy */
+        int wait_policy;
+        /** number of sweeps the sequential implementation fuses into one pass */
+        int temporal_depth;
+        /** width of the column panels of a blocked sweep, 0 for whole rows, GS_PANELS_AUTO to fit them in cache */
+        int panel_cols;
+        /** over-relaxation factor in (0, 2), 1 for plain Gauss-Seidel, GS_OMEGA_AUTO to estimate it */
+        double omega;
+        /** multigrid cycle, see enum gs_cycle */
+        int cycle;
+        /** pages to allocate the matrix and buffers of its size on, see enum gs_pages */
+        int pages;
+        /** 1 to fault in the pages of those allocations right away */
+        int populate;
+        /** storage layout of the matrix, see enum gs_layout */
+        int layout;
+        /** storage for the matrix, see gs_ctx_matrix_size(), NULL to allocate it */
+        double *matrix;
+};
+
+/** A solve and everything it owns */
+struct gs_context {
+        /** parameters the context was created with */
+        struct gs_params params;
+        /** width of matrix (size + padding) */
+        int width;
+        /** tiles per row of a tiled layout */
+        int tiles;
+        /** width of the rows of each colour of GS_LAYOUT_REDBLACK */
+        int split_width;
+        /** pointer to the matrix to run GS on */
+        double *matrix;
+        /** backend running the solve */
+        const struct gs_backend *backend;
+        /** worker threads, NULL if nthreads is 1 */
+        struct gs_pool *pool;
+        /** state of the backend, set up by its init() */
+        void *priv;
+
+        /** number of sweeps run by the last solve */
+        int iterations;
+        /** error of the last sweep */
+        double error;
+        /** over-relaxation factor of the last solve, once estimated */
+        double omega;
+        /** error at the middle of the current trial period */
+        double omega_trial_error;
+        /** 1 once the estimate of omega has stopped */
+        int omega_settled;
+
+        /** memory of the matrix, if owned by the context */
+        struct gs_buffer matrix_buffer;
+
+        int owns_matrix, owns_pool;
+};
+
+/** Command line options that only some backends understand */
+enum gs_backend_option {
+        /** -t and -a, number of threads and their binding */
+        GS_OPT_THREADS = 1 << 0,
+        /** -r and -c, tile size */
+        GS_OPT_TILES = 1 << 1,
+        /** -W, wait policy */
+        GS_OPT_WAIT = 1 << 2,
+        /** -T, fused sweeps */
+        GS_OPT_FUSE = 1 << 3,
+        /** -P, panel width */
+        GS_OPT_PANELS = 1 << 4,
+        /** -w, over-relaxation */
+        GS_OPT_OMEGA = 1 << 5,
+        /** -m, multigrid cycle */
+        GS_OPT_CYCLE = 1 << 6,
+};
+
+/** An implementation of the GS algorithm */
+struct gs_backend {
+        /** Name used to select the backend */
+        const char *name;
+        /** One line description for the usage text */
+        const char *description;
+        /** Options the backend understands, see enum gs_backend_option */
+        unsigned options;
+        /** Layouts other than GS_LAYOUT_ROWS the backend can sweep, a bit
+         * 1 << layout for each, see enum gs_layout */
+        unsigned layouts;
+
+        /**
+         * Set up the state of the backend in ctx->priv. Called before
+         * the matrix is initialized, so the backend gets to touch it
+         * first.
+         */
+        void (*init)(struct gs_context *ctx);
+        /**
+         * Execute the backend's implementation of the GS algorithm and
+         * store its outcome in ctx->iterations and ctx->error.
+         */
+        void (*calculate)(struct gs_context *ctx);
+        /**
+         * Cleanup the state of the backend.
+         */
+        void (*finish)(struct gs_context *ctx);
+};
+
+/**
+ * Make a backend available. Called before main() by
+ * GS_REGISTER_BACKEND().
+ */
+extern void gs_register_backend(const struct gs_backend *backend);
+
+/**
+ * Register a struct gs_backend when the program starts.
+ */
+#define GS_REGISTER_BACKEND(backend)                                    \
+        static void __attribute__((constructor))                        \
+        register_ ## backend()                                          \
+        {                                                               \
+                gs_register_backend(&backend);                          \
+        }
 
 /**
- * Initialize local data used by the GS implementation.
+ * Get a registered backend.
+ *
+ * \param index Index of the backend, they are sorted by name
+ * \return The backend, or NULL if index is past the last one
+ */
+extern const struct gs_backend *gs_backend_get(int index);
+
+/**
+ * Find a registered backend by name.
+ *
+ * \return The backend, or NULL if there is none by that name
  */
-extern void gsi_init();
+extern const struct gs_backend *gs_backend_find(const char *name);
+
+/**
+ * Get the number of bytes the matrix of a solve with params takes. The
+ * tiled layouts round the size up to whole tiles, and GS_LAYOUT_MORTON
+ * to a power of two number of them. GS_LAYOUT_REDBLACK rounds the
+ * width up to an even number. Without padding, that is enough for the
+ * row-major layout as well.
+ */
+extern size_t gs_ctx_matrix_size(const struct gs_params *params);
+
 /**
- * Cleanup local data used by the GS implementation.
+ * Create a solver context and fill its matrix with the initial values.
+ * Backends that can't sweep the layout of params get GS_LAYOUT_ROWS.
+ *
+ * \param pool Worker threads to run on, shared with other contexts. If
+ *             NULL, the context starts its own when it needs them.
+ * \return The context, or NULL if the parameters are invalid or it
+ *         couldn't be set up
  */
-extern void gsi_finish();
+extern struct gs_context *gs_ctx_create(const struct gs_params *params,
+                                        struct gs_pool *pool);
 
 /**
- * Execute the implementation of the GS algorithm.
+ * Run the solve. Can be called again after the matrix has been reset
+ * by gs_ctx_reset(), or filled in by the caller.
+ *
+ * \return 1 if the solution converged, 0 otherwise
  */
-extern void gsi_calculate();
+extern int gs_ctx_solve(struct gs_context *ctx);
+
+/** Value of gs_params.panel_cols that fits the panels in the cache of
+ * this machine. The errors are then summed panel by panel, and may
+ * differ in the last bits from one machine to the next. */
+#define GS_PANELS_AUTO GS_KERNEL_PANELS_AUTO
 
+/** Value of gs_params.omega that has every solve estimate its own */
+#define GS_OMEGA_AUTO -1.0
 
-/** 1 if verbose output is enabled */
-extern int gs_verbose;
+/** Shortest number of sweeps between two estimates of omega */
+#define GS_OMEGA_TRIAL_SWEEPS 16
+
+/**
+ * Get the over-relaxation factor of the current sweep. With
+ * GS_OMEGA_AUTO, the first trial period is plain Gauss-Seidel, and the
+ * factor is estimated again at the end of every period after that, see
+ * gs_ctx_omega_observe(). The periods are GS_OMEGA_TRIAL_SWEEPS or a
+ * quarter of the grid size long, whichever is more.
+ */
+extern double gs_ctx_omega(const struct gs_context *ctx);
+
+/**
+ * Get the number of sweeps from iteration on that are sure to run with
+ * the same omega, up to the end of the current trial period.
+ */
+extern int gs_ctx_omega_sweeps(const struct gs_context *ctx, int iteration);
 
-/** size of matrix (excluding padding) */
-extern int gs_size;
-/** width of matrix (size + padding) */
-extern int gs_width;
-/** number of iterations to run */
-extern int gs_iterations;
-/** maximum error for convergence */
-extern double gs_tolerance;
-/** number elements of padding on the sides of the matrix */
-extern int gs_padding;
-/** number of threads to use */
-extern int gs_nthreads;
+/**
+ * Check if the estimate of omega needs the exact error of a sweep.
+ */
+extern int gs_ctx_omega_wants(const struct gs_context *ctx, int iteration);
+
+/**
+ * Hand the error of a sweep to the estimate of omega. Ignored unless
+ * gs_ctx_omega_wants() asked for it. The last sweep of a trial period
+ * may change omega, so it must be observed before any thread asks
+ * gs_ctx_omega() for the next one, and no thread may be sweeping.
+ *
+ * The errors eventually decay by a factor lambda per sweep. Below the
+ * optimal omega, lambda relates to the spectral radius mu of the Jacobi
+ * iteration by (lambda + omega - 1)^2 = lambda omega^2 mu^2, and the
+ * optimal factor is 2 / (1 + sqrt(1 - mu^2)). Every trial period moves
+ * omega up to that estimate, until lambda gets close to omega - 1.
+ */
+extern void gs_ctx_omega_observe(struct gs_context *ctx, int iteration,
+                                 double error);
+
+/**
+ * Fill the matrix of a context with the initial values.
+ */
+extern void gs_ctx_reset(struct gs_context *ctx);
+
+/**
+ * Free a context and everything it owns.
+ */
+extern void gs_ctx_destroy(struct gs_context *ctx);
+
+/** Outcome of one problem of a batch */
+struct gs_batch_result {
+        /** 1 if the solution converged */
+        int converged;
+        /** number of sweeps run */
+        int iterations;
+        /** error of the last sweep */
+        double error;
+};
+
+/**
+ * Solve many independent problems of the same shape, each of them on a
+ * single thread. Every thread keeps a context of its own and takes the
+ * next unsolved problem whenever it is done with one, so the problems
+ * don't need to take the same time. Suited to grids too small for a
+ * threaded backend to pay for its synchronization.
+ *
+ * \param params Parameters of every problem, nthreads is ignored
+ * \param fill Called to fill in the matrix of a problem before it is
+ *             solved. NULL to start every problem from the initial
+ *             values of gs_ctx_reset().
+ * \param pool Worker threads, at least nthreads - 1 of them
+ * \param results Outcome of each problem
+ * \return The number of problems that converged, or -1 if the
+ *         contexts couldn't be created
+ */
+extern int gs_batch_solve(const struct gs_params *params, int nproblems,
+                          void (*fill)(struct gs_context *ctx, int problem,
+                                       void *arg),
+                          void *arg, struct gs_pool *pool, int nthreads,
+                          struct gs_batch_result *results);
+
+/**
+ * Like gs_batch_solve(), but every thread solves GS_KERNEL_BATCH_LANES
+ * problems at once. Their grids are stored interleaved, so that one
+ * SIMD lane holds the same point of each problem, and swept together by
+ * gs_kernel_sweep_interleaved(). A problem stops being updated once it
+ * has converged.
+ *
+ * The sweep is the lexicographic one of the seq backend without fused
+ * sweeps, narrow panels or over-relaxation, and the results are
+ * bit-identical to it. The backend of params is only used for the
+ * contexts passed to fill.
+ */
+extern int gs_batch_solve_interleaved(const struct gs_params *params,
+                                      int nproblems,
+                                      void (*fill)(struct gs_context *ctx,
+                                                   int problem, void *arg),
+                                      void *arg, struct gs_pool *pool,
+                                      int nthreads,
+                                      struct gs_batch_result *results);
+
+/**
+ * Calculate the index of the first element of a tile of a context with
+ * a tiled layout.
+ */
+static inline size_t
+gs_tile_base(const struct gs_context *ctx, int tile_row, int tile_col)
+{
+        size_t tile = 0;
+
+        if (ctx->params.layout == GS_LAYOUT_TILES) {
+                tile = (size_t)tile_row * ctx->tiles + tile_col;
+        } else {
+                /* Interleave the bits, the row ones go first */
+                for (int b = 0; (tile_row | tile_col) >> b; b++)
+                        tile |= (size_t)((tile_col >> b) & 1) << 2 * b |
+                                (size_t)((tile_row >> b) & 1) << (2 * b + 1);
+        }
+
+        return tile * GS_TILE_SIZE * GS_TILE_SIZE;
+}
+
+/**
+ * Calculate the index of an element in a tiled matrix.
+ */
+static inline size_t
+gs_tile_index(const struct gs_context *ctx, int row, int col)
+{
+        return gs_tile_base(ctx, row / GS_TILE_SIZE, col / GS_TILE_SIZE) +
+                row % GS_TILE_SIZE * GS_TILE_SIZE + col % GS_TILE_SIZE;
+}
+
+/**
+ * Calculate the index of the first element of a colour of a context
+ * with GS_LAYOUT_REDBLACK, see enum gs_colour. Element (i, j) of the
+ * colour is at index split_width * i + j / 2 from there, whichever
+ * colour the row starts with, so its neighbours in the other colour
+ * are at the same index in the rows above and below, and next to it in
+ * the same row.
+ */
+static inline size_t
+gs_colour_base(const struct gs_context *ctx, int colour)
+{
+        return (size_t)colour * ctx->params.size * ctx->split_width;
+}
+
+/**
+ * Calculate the index of an element in a matrix with a layout other
+ * than GS_LAYOUT_ROWS.
+ */
+static inline size_t
+gs_layout_index(const struct gs_context *ctx, int row, int col)
+{
+        if (ctx->params.layout == GS_LAYOUT_REDBLACK)
+                return gs_colour_base(ctx, (row + col) & 1) +
+                        (size_t)ctx->split_width * row + col / 2;
 
-/** pointer to the matrix to run GS on */
-extern double *gs_matrix;
+        return gs_tile_index(ctx, row, col);
+}
 
 /**
- * Calculate the index of an element in the matrix based on the row
- * and column
+ * Calculate the index of an element in the matrix of a context based
+ * on the row and column. Rows and columns are ints, the index is a
+ * size_t: the matrix may have more than 2^31 elements.
  */
-#define GS_INDEX(row, col) (gs_width * (row) + (col))
+#define GS_INDEX(ctx, row, col)                                         \
+        ((ctx)->params.layout == GS_LAYOUT_ROWS ?                       \
+         (size_t)(ctx)->width * (row) + (col) :                         \
+         gs_layout_index(ctx, row, col))
 
 /**
- * Print verbose output.
+ * Print verbose output, if enabled for the context.
  */
-extern void gs_verbose_printf(const char *fmt, ...);
+extern void gs_verbose_printf(const struct gs_context *ctx,
+                              const char *fmt, ...);
 
 #ifndef MIN
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
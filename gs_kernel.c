@@ -0,0 +1,943 @@
+/**
+ * Gauss-Seidel sweep kernels shared by the implementations.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gs_kernel.h"
+#include "topology.h"
+
+/* Number of lanes of the widest SIMD kernel */
+#define MAX_LANES 8
+
+/* Height of the strips of a blocked sweep, a multiple of MAX_LANES */
+#define BLOCK_ROWS 32
+/* Panels are a multiple of this many columns wide */
+#define BLOCK_COLS_ALIGN 64
+/* Cache size to assume if it can't be detected */
+#define DEFAULT_L2_SIZE (256 * 1024)
+/* Largest padding gs_kernel_padding() tries, in cache lines */
+#define MAX_PAD_LINES 64
+/* Deepest cache level gs_kernel_padding() looks at */
+#define MAX_CACHE_LEVEL 4
+/* Lines of each row a SIMD kernel streams through at a time */
+#define WINDOW_LINES 2
+
+/* The SIMD kernels are compiled with x86 target attributes and picked
+ * at runtime, other architectures only get the portable ones */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#endif
+
+/* Indices are 64-bit, a matrix may have more than 2^31 elements */
+#define INDEX(row, col) ((ptrdiff_t)width * (row) + (col))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef double (*kernel_t)(double *, int, int, int, int, int,
+                           double, double, double *);
+typedef double (*rb_kernel_t)(double *, int, int, int, int, int,
+                              int, double, double);
+typedef void (*interleaved_kernel_t)(double *, int, int, int, int, int,
+                                     const int *, double *);
+typedef double (*rb_split_kernel_t)(double *, const double *, int,
+                                    int, int, int, int, int, double, double);
+typedef double (*jacobi_kernel_t)(const double *, double *, int,
+                                  int, int, int, int, double);
+
+/**
+ * Plain lexicographic sweep. This is the reference all other kernels
+ * must match bit for bit.
+ *
+ * With an omega other than 1, the new value is over-relaxed to
+ * old + omega * (new - old). Plain Gauss-Seidel doesn't go through
+ * that, as it doesn't round to the same value.
+ */
+static double
+sweep_scalar(double *m, int width, int r0, int r1, int c0, int c1,
+             double omega, double error, double *scratch)
+{
+        (void)scratch;
+
+        for (int i = r0; i < r1; i++) {
+                for (int j = c0; j < c1; j++) {
+                        double new_value = 0.25 * (
+                                m[INDEX(i + 1, j)] +
+                                m[INDEX(i - 1, j)] +
+                                m[INDEX(i, j + 1)] +
+                                m[INDEX(i, j - 1)]);
+
+                        if (omega != 1.0)
+                                new_value = m[INDEX(i, j)] + omega *
+                                        (new_value - m[INDEX(i, j)]);
+                        error += fabs(m[INDEX(i, j)] - new_value);
+
+                        m[INDEX(i, j)] = new_value;
+                }
+        }
+
+        return error;
+}
+
+/**
+ * Plain red-black half sweep, updating the points of one colour.
+ */
+static double
+rb_sweep_scalar(double *m, int width, int r0, int r1, int c0, int c1,
+                int colour, double omega, double error)
+{
+        for (int i = r0; i < r1; i++) {
+                for (int j = c0 + ((i + c0 + colour) & 1); j < c1; j += 2) {
+                        double new_value = 0.25 * (
+                                m[INDEX(i + 1, j)] +
+                                m[INDEX(i - 1, j)] +
+                                m[INDEX(i, j + 1)] +
+                                m[INDEX(i, j - 1)]);
+
+                        if (omega != 1.0)
+                                new_value = m[INDEX(i, j)] + omega *
+                                        (new_value - m[INDEX(i, j)]);
+                        error += fabs(m[INDEX(i, j)] - new_value);
+
+                        m[INDEX(i, j)] = new_value;
+                }
+        }
+
+        return error;
+}
+
+/* Elements of row i of a colour between the columns [c0, c1) */
+#define SPLIT_FIRST(c0, s) (((c0) - (s) + 1) / 2)
+#define SPLIT_END(c1, s) (((c1) - (s) + 1) / 2)
+
+/**
+ * Plain red-black half sweep over the points of one colour stored
+ * apart, see gs_kernel_rb_split_sweep().
+ */
+static double
+rb_split_sweep_scalar(double *m, const double *o, int width, int r0, int r1,
+                      int c0, int c1, int colour, double omega, double error)
+{
+        for (int i = r0; i < r1; i++) {
+                const int s = (i + colour) & 1;
+                double *row = m + INDEX(i, 0);
+                const double *up = o + INDEX(i - 1, 0);
+                const double *down = o + INDEX(i + 1, 0);
+                const double *west = o + INDEX(i, 0) - 1 + s;
+                const double *east = o + INDEX(i, 0) + s;
+
+                for (int k = SPLIT_FIRST(c0, s); k < SPLIT_END(c1, s); k++) {
+                        double new_value = 0.25 * (
+                                down[k] + up[k] + east[k] + west[k]);
+
+                        if (omega != 1.0)
+                                new_value = row[k] + omega *
+                                        (new_value - row[k]);
+                        error += fabs(row[k] - new_value);
+
+                        row[k] = new_value;
+                }
+        }
+
+        return error;
+}
+
+/**
+ * Plain Jacobi sweep, computing every point of dst from its neighbours
+ * in src.
+ */
+static double
+jacobi_sweep_scalar(const double *src, double *dst, int width,
+                    int r0, int r1, int c0, int c1, double error)
+{
+        for (int i = r0; i < r1; i++) {
+                for (int j = c0; j < c1; j++) {
+                        double new_value = 0.25 * (
+                                src[INDEX(i + 1, j)] +
+                                src[INDEX(i - 1, j)] +
+                                src[INDEX(i, j + 1)] +
+                                src[INDEX(i, j - 1)]);
+
+                        error += fabs(src[INDEX(i, j)] - new_value);
+                        dst[INDEX(i, j)] = new_value;
+                }
+        }
+
+        return error;
+}
+
+/*
+ * Wavefront SIMD kernels.
+ *
+ * In lexicographic order a point needs the new values of its north and
+ * west neighbours, so the points of a row can't be updated in
+ * parallel. The points on an anti-diagonal can. We therefore handle
+ * the block in strips of V rows and give every row a lane, with lane l
+ * running l columns behind lane 0. The strip is copied into a skewed
+ * scratch buffer where slot (t, l) holds row i0 + l, column
+ * c0 - 1 + t - l, so that step t is a single vector:
+ *
+ *   north = lane l - 1 of step t - 1 (lane 0 reads the row above)
+ *   west  = lane l     of step t - 1
+ *   south = lane l + 1 of step t + 1 (lane V-1 reads the row below)
+ *   east  = lane l     of step t + 1
+ *
+ * Steps t - 1 are already updated and steps t + 1 aren't, exactly as
+ * in lexicographic order. Lanes outside [c0, c1) pass their value
+ * through unchanged. The arithmetic is the same as in sweep_scalar(),
+ * operation by operation, and FP contraction is off in ISO C mode, so
+ * every new value is bit-identical.
+ *
+ * The per-point errors go to a second skewed buffer and are summed in
+ * lexicographic order as well. That sum is a serial chain of one add
+ * per point, which bounds the kernel at about twice the speed of the
+ * scalar loop. To get close to that bound, the loop computing strip s
+ * also writes back and sums up strip s - 1 and skews strip s + 1, so
+ * that the three chains overlap. The row above strip s is therefore
+ * read from the buffer of strip s - 1, which hasn't been written back
+ * yet.
+ */
+typedef double v2df __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef double v4df __attribute__((vector_size(32)));
+typedef long long v4di __attribute__((vector_size(32)));
+typedef double v8df __attribute__((vector_size(64)));
+typedef long long v8di __attribute__((vector_size(64)));
+
+/* Slot of row l, column c0 + j of a strip in its skewed buffer */
+#define SKEW(V, l, j) (((j) + (l) + 1) * (V) + (l))
+
+#define DEFINE_WAVEFRONT_KERNEL(NAME, TARGET, V, VDF, VDI, LANES,        \
+                                NORTH_SHIFT, SOUTH_SHIFT)                \
+static double __attribute__((target(TARGET)))                            \
+NAME(double *m, int width, int r0, int r1, int c0, int c1,               \
+     double omega, double error, double *scratch)                        \
+{                                                                        \
+        const int ncols = c1 - c0;                                       \
+        const int nsteps = ncols + V + 1;                                \
+        const int nstrips = ncols > 0 ? (r1 - r0) / V : 0;               \
+        const VDI lane = LANES;                                          \
+        const VDI abs_mask = (VDI){ 0 } + 0x7fffffffffffffffLL;          \
+        /* Buffers of the strips being retired, computed and skewed */   \
+        double *old_b = scratch, *old_d = old_b + nsteps * V;            \
+        double *cur_b = old_d + nsteps * V, *cur_d = cur_b + nsteps * V; \
+        double *next_b = cur_d + nsteps * V, *next_d = next_b + nsteps * V; \
+                                                                         \
+        if (nstrips == 0)                                                \
+                return sweep_scalar(m, width, r0, r1, c0, c1, omega,     \
+                                    error, NULL);                        \
+                                                                         \
+        /* The slots before and after the skewed rows are never          \
+         * written, keep them from holding NaNs or denormals */          \
+        for (int l = 0; l < V; l++) {                                    \
+                for (int t = 0; t < nsteps; t++) {                       \
+                        if (t >= l && t <= l + ncols + 1)                \
+                                t = l + ncols + 1;                       \
+                        else                                             \
+                                old_b[t * V + l] = cur_b[t * V + l] =    \
+                                        next_b[t * V + l] = 0.0;         \
+                }                                                        \
+        }                                                                \
+                                                                         \
+        /* The row above the block plays the last row of strip -1 */     \
+        for (int j = -1; j <= ncols; j++)                                \
+                old_b[SKEW(V, V - 1, j)] = m[INDEX(r0 - 1, c0 + j)];     \
+        for (int l = 0; l < V; l++) {                                    \
+                for (int j = -1; j <= ncols; j++)                        \
+                        cur_b[SKEW(V, l, j)] = m[INDEX(r0 + l, c0 + j)]; \
+        }                                                                \
+                                                                         \
+        for (int s = 0; s < nstrips; s++) {                              \
+                const int i0 = r0 + s * V;                               \
+                const int retire = s > 0, skew = s + 1 < nstrips;        \
+                const VDF *b = (const VDF *)cur_b;                       \
+                VDF *nb = (VDF *)cur_b, *nd = (VDF *)cur_d;              \
+                int er = 0, ej = 0;                                      \
+                VDF prev = b[0];                                         \
+                                                                         \
+                for (int t = 1; t < nsteps - 1; t++) {                   \
+                        VDF old = b[t];                                  \
+                        VDF next = b[t + 1];                             \
+                        double top = t <= ncols ?                        \
+                                old_b[SKEW(V, V - 1, t - 1)] : 0.0;      \
+                        double bottom = t >= V && t <= V - 1 + ncols ?   \
+                                m[INDEX(i0 + V, c0 - V + t)] : 0.0;      \
+                        VDF north = __builtin_shuffle(                   \
+                                prev, (VDF){ 0 } + top, NORTH_SHIFT);    \
+                        VDF south = __builtin_shuffle(                   \
+                                next, (VDF){ 0 } + bottom, SOUTH_SHIFT); \
+                        VDF new_value = 0.25 * (                         \
+                                south + north + next + prev);            \
+                        if (omega != 1.0)                                \
+                                new_value = old + omega *                \
+                                        (new_value - old);               \
+                        VDF diff = (VDF)((VDI)(old - new_value) & abs_mask); \
+                        VDI active = (lane < t) & (lane >= t - ncols);   \
+                                                                         \
+                        new_value = (VDF)(((VDI)new_value & active) |    \
+                                          ((VDI)old & ~active));         \
+                        nb[t] = new_value;                               \
+                        nd[t] = (VDF)((VDI)diff & active);               \
+                        prev = new_value;                                \
+                                                                         \
+                        /* Previous strip: one column back to the        \
+                         * matrix, V errors to the sum */                \
+                        if (retire && t <= ncols) {                      \
+                                for (int l = 0; l < V; l++)              \
+                                        m[INDEX(i0 - V + l, c0 + t - 1)] = \
+                                                old_b[SKEW(V, l, t - 1)]; \
+                                for (int k = 0; k < V; k++) {            \
+                                        error += old_d[SKEW(V, er, ej)]; \
+                                        if (++ej == ncols) {             \
+                                                ej = 0;                  \
+                                                er++;                    \
+                                        }                                \
+                                }                                        \
+                        }                                                \
+                                                                         \
+                        /* Next strip: one column into its buffer */     \
+                        if (skew && t <= ncols + 2) {                    \
+                                for (int l = 0; l < V; l++)              \
+                                        next_b[SKEW(V, l, t - 2)] =      \
+                                                m[INDEX(i0 + V + l,      \
+                                                        c0 + t - 2)];    \
+                        }                                                \
+                }                                                        \
+                                                                         \
+                /* With V = 2 the steps end before the east boundary */  \
+                for (int t = nsteps - 1; skew && t <= ncols + 2; t++) {  \
+                        for (int l = 0; l < V; l++)                      \
+                                next_b[SKEW(V, l, t - 2)] =              \
+                                        m[INDEX(i0 + V + l, c0 + t - 2)]; \
+                }                                                        \
+                                                                         \
+                double *tmp_b = old_b, *tmp_d = old_d;                   \
+                old_b = cur_b; old_d = cur_d;                            \
+                cur_b = next_b; cur_d = next_d;                          \
+                next_b = tmp_b; next_d = tmp_d;                          \
+        }                                                                \
+                                                                         \
+        /* Retire the last strip */                                      \
+        for (int l = 0; l < V; l++) {                                    \
+                for (int j = 0; j < ncols; j++) {                        \
+                        m[INDEX(r0 + (nstrips - 1) * V + l, c0 + j)] =   \
+                                old_b[SKEW(V, l, j)];                    \
+                        error += old_d[SKEW(V, l, j)];                   \
+                }                                                        \
+        }                                                                \
+                                                                         \
+        /* Rows that don't fill a strip */                               \
+        return sweep_scalar(m, width, r0 + nstrips * V, r1, c0, c1,      \
+                            omega, error, NULL);                         \
+}
+
+#ifdef HAVE_X86_KERNELS
+DEFINE_WAVEFRONT_KERNEL(sweep_sse2, "sse2", 2, v2df, v2di,
+                        ((v2di){ 0, 1 }),
+                        ((v2di){ 2, 0 }),
+                        ((v2di){ 1, 2 }))
+
+DEFINE_WAVEFRONT_KERNEL(sweep_avx2, "avx2", 4, v4df, v4di,
+                        ((v4di){ 0, 1, 2, 3 }),
+                        ((v4di){ 4, 0, 1, 2 }),
+                        ((v4di){ 1, 2, 3, 4 }))
+
+DEFINE_WAVEFRONT_KERNEL(sweep_avx512, "avx512f", 8, v8df, v8di,
+                        ((v8di){ 0, 1, 2, 3, 4, 5, 6, 7 }),
+                        ((v8di){ 8, 0, 1, 2, 3, 4, 5, 6 }),
+                        ((v8di){ 1, 2, 3, 4, 5, 6, 7, 8 }))
+#endif
+
+/*
+ * Red-black SIMD kernels.
+ *
+ * The neighbours of a point all have the other colour, so the points
+ * of one colour are independent. Rather than gathering every other
+ * element, we compute a full vector of unit-stride neighbours and only
+ * store the lanes of our colour, the others get their old value back.
+ * The west neighbours are shifted in from the previous vector rather
+ * than loaded, as a load overlapping the store of the previous vector
+ * can't be forwarded and stalls. They are all of the colour we don't
+ * update, so the old values are the right ones. Half of the arithmetic
+ * is wasted, but the loop runs at the speed of the loads.
+ *
+ * Writing the other colour back, and loading it with the neighbours,
+ * touches points outside the colour being updated. Other threads read
+ * and write those of the rows next to their own rows at the same time,
+ * so the first and last row of [r0, r1) go through rb_sweep_scalar(),
+ * which only touches the points it needs.
+ *
+ * The errors are summed per lane and folded into error at the end of
+ * each row, so the error differs from the scalar kernel in the last
+ * bits. The matrix doesn't.
+ */
+typedef double v2df_u __attribute__((vector_size(16), aligned(8), may_alias));
+typedef double v4df_u __attribute__((vector_size(32), aligned(8), may_alias));
+typedef double v8df_u __attribute__((vector_size(64), aligned(8), may_alias));
+
+#define DEFINE_RB_KERNEL(NAME, TARGET, V, VDF, VDF_U, VDI, LANES,        \
+                         WEST_SHIFT)                                     \
+static double __attribute__((target(TARGET)))                            \
+NAME(double *m, int width, int r0, int r1, int c0, int c1,               \
+     int colour, double omega, double error)                             \
+{                                                                        \
+        const VDI lane = LANES;                                          \
+        const VDI abs_mask = (VDI){ 0 } + 0x7fffffffffffffffLL;          \
+        const VDI even = (lane & 1) == 0;                                \
+                                                                         \
+        if (r1 - r0 <= 2)                                                \
+                return rb_sweep_scalar(m, width, r0, r1, c0, c1,         \
+                                       colour, omega, error);            \
+        error = rb_sweep_scalar(m, width, r0, r0 + 1, c0, c1,            \
+                                colour, omega, error);                   \
+                                                                         \
+        for (int i = r0 + 1; i < r1 - 1; i++) {                          \
+                double *row = m + INDEX(i, 0);                           \
+                const double *up = row - width, *down = row + width;     \
+                /* Lanes of our colour, c0 + k has the parity of k */    \
+                const VDI mask = (i + c0 + colour) & 1 ? ~even : even;   \
+                VDF acc = { 0 };                                         \
+                VDF prev = (VDF){ 0 } + row[c0 - 1];                     \
+                int j;                                                   \
+                                                                         \
+                for (j = c0; j + V <= c1; j += V) {                      \
+                        VDF old = *(VDF_U *)(row + j);                   \
+                        VDF new_value = 0.25 * (                         \
+                                *(const VDF_U *)(down + j) +             \
+                                *(const VDF_U *)(up + j) +               \
+                                *(const VDF_U *)(row + j + 1) +          \
+                                __builtin_shuffle(prev, old, WEST_SHIFT)); \
+                        if (omega != 1.0)                                \
+                                new_value = old + omega *                \
+                                        (new_value - old);               \
+                        VDF diff = (VDF)((VDI)(old - new_value) & abs_mask); \
+                                                                         \
+                        *(VDF_U *)(row + j) =                            \
+                                (VDF)(((VDI)new_value & mask) |          \
+                                      ((VDI)old & ~mask));               \
+                        acc += (VDF)((VDI)diff & mask);                  \
+                        prev = old;                                      \
+                }                                                        \
+                for (int k = 0; k < V; k++)                              \
+                        error += acc[k];                                 \
+                                                                         \
+                /* Points of our colour that don't fill a vector */      \
+                for (j += (i + j + colour) & 1; j < c1; j += 2) {        \
+                        double new_value = 0.25 * (                      \
+                                down[j] + up[j] + row[j + 1] + row[j - 1]); \
+                        if (omega != 1.0)                                \
+                                new_value = row[j] + omega *             \
+                                        (new_value - row[j]);            \
+                        error += fabs(row[j] - new_value);               \
+                        row[j] = new_value;                              \
+                }                                                        \
+        }                                                                \
+                                                                         \
+        return rb_sweep_scalar(m, width, r1 - 1, r1, c0, c1,             \
+                               colour, omega, error);                    \
+}
+
+#ifdef HAVE_X86_KERNELS
+DEFINE_RB_KERNEL(rb_sweep_sse2, "sse2", 2, v2df, v2df_u, v2di,
+                 ((v2di){ 0, 1 }),
+                 ((v2di){ 1, 2 }))
+
+DEFINE_RB_KERNEL(rb_sweep_avx2, "avx2", 4, v4df, v4df_u, v4di,
+                 ((v4di){ 0, 1, 2, 3 }),
+                 ((v4di){ 3, 4, 5, 6 }))
+
+DEFINE_RB_KERNEL(rb_sweep_avx512, "avx512f", 8, v8df, v8df_u, v8di,
+                 ((v8di){ 0, 1, 2, 3, 4, 5, 6, 7 }),
+                 ((v8di){ 7, 8, 9, 10, 11, 12, 13, 14 }))
+#endif
+
+/*
+ * Split red-black SIMD kernels.
+ *
+ * With the colours stored apart, a half sweep is a Jacobi sweep from
+ * one array into the other: every vector of points is computed from
+ * unit-stride loads of its neighbours, with nothing to mask and no
+ * lanes wasted. Half as many cache lines are read per half sweep as
+ * with the colours interleaved. The errors are summed like in the
+ * other red-black kernels.
+ */
+#define DEFINE_RB_SPLIT_KERNEL(NAME, TARGET, V, VDF, VDF_U, VDI)         \
+static double __attribute__((target(TARGET)))                            \
+NAME(double *m, const double *o, int width, int r0, int r1,              \
+     int c0, int c1, int colour, double omega, double error)             \
+{                                                                        \
+        const VDI abs_mask = (VDI){ 0 } + 0x7fffffffffffffffLL;          \
+                                                                         \
+        for (int i = r0; i < r1; i++) {                                  \
+                const int s = (i + colour) & 1;                          \
+                const int k1 = SPLIT_END(c1, s);                         \
+                double *row = m + INDEX(i, 0);                           \
+                const double *up = o + INDEX(i - 1, 0);                  \
+                const double *down = o + INDEX(i + 1, 0);                \
+                const double *west = o + INDEX(i, 0) - 1 + s;            \
+                const double *east = o + INDEX(i, 0) + s;                \
+                VDF acc = { 0 };                                         \
+                int k;                                                   \
+                                                                         \
+                for (k = SPLIT_FIRST(c0, s); k + V <= k1; k += V) {      \
+                        VDF old = *(VDF_U *)(row + k);                   \
+                        VDF new_value = 0.25 * (                         \
+                                *(const VDF_U *)(down + k) +             \
+                                *(const VDF_U *)(up + k) +               \
+                                *(const VDF_U *)(east + k) +             \
+                                *(const VDF_U *)(west + k));             \
+                        if (omega != 1.0)                                \
+                                new_value = old + omega *                \
+                                        (new_value - old);               \
+                                                                         \
+                        acc += (VDF)((VDI)(old - new_value) & abs_mask); \
+                        *(VDF_U *)(row + k) = new_value;                 \
+                }                                                        \
+                for (int l = 0; l < V; l++)                              \
+                        error += acc[l];                                 \
+                                                                         \
+                for (; k < k1; k++) {                                    \
+                        double new_value = 0.25 * (                      \
+                                down[k] + up[k] + east[k] + west[k]);    \
+                        if (omega != 1.0)                                \
+                                new_value = row[k] + omega *             \
+                                        (new_value - row[k]);            \
+                        error += fabs(row[k] - new_value);               \
+                        row[k] = new_value;                              \
+                }                                                        \
+        }                                                                \
+                                                                         \
+        return error;                                                    \
+}
+
+#ifdef HAVE_X86_KERNELS
+DEFINE_RB_SPLIT_KERNEL(rb_split_sweep_sse2, "sse2", 2, v2df, v2df_u, v2di)
+DEFINE_RB_SPLIT_KERNEL(rb_split_sweep_avx2, "avx2", 4, v4df, v4df_u, v4di)
+DEFINE_RB_SPLIT_KERNEL(rb_split_sweep_avx512, "avx512f", 8, v8df, v8df_u,
+                       v8di)
+#endif
+
+/*
+ * Jacobi SIMD kernels.
+ *
+ * The points of a Jacobi sweep don't depend on each other at all, so
+ * a row is simply computed a vector at a time. As in the red-black
+ * kernels, the errors are summed per lane and folded into error at the
+ * end of each row. The new values are the same as those of the scalar
+ * loop, the error may differ in the last bits.
+ */
+#define DEFINE_JACOBI_KERNEL(NAME, TARGET, V, VDF, VDF_U, VDI)           \
+static double __attribute__((target(TARGET)))                            \
+NAME(const double *src, double *dst, int width, int r0, int r1,          \
+     int c0, int c1, double error)                                       \
+{                                                                        \
+        const VDI abs_mask = (VDI){ 0 } + 0x7fffffffffffffffLL;          \
+                                                                         \
+        for (int i = r0; i < r1; i++) {                                  \
+                const double *row = src + INDEX(i, 0);                   \
+                const double *up = row - width, *down = row + width;     \
+                double *out = dst + INDEX(i, 0);                         \
+                VDF acc = { 0 };                                         \
+                int j;                                                   \
+                                                                         \
+                for (j = c0; j + V <= c1; j += V) {                      \
+                        VDF old = *(const VDF_U *)(row + j);             \
+                        VDF new_value = 0.25 * (                         \
+                                *(const VDF_U *)(down + j) +             \
+                                *(const VDF_U *)(up + j) +               \
+                                *(const VDF_U *)(row + j + 1) +          \
+                                *(const VDF_U *)(row + j - 1));          \
+                                                                         \
+                        acc += (VDF)((VDI)(old - new_value) & abs_mask); \
+                        *(VDF_U *)(out + j) = new_value;                 \
+                }                                                        \
+                for (int k = 0; k < V; k++)                              \
+                        error += acc[k];                                 \
+                                                                         \
+                for (; j < c1; j++) {                                    \
+                        double new_value = 0.25 * (                      \
+                                down[j] + up[j] + row[j + 1] + row[j - 1]); \
+                        error += fabs(row[j] - new_value);               \
+                        out[j] = new_value;                              \
+                }                                                        \
+        }                                                                \
+                                                                         \
+        return error;                                                    \
+}
+
+#ifdef HAVE_X86_KERNELS
+DEFINE_JACOBI_KERNEL(jacobi_sweep_sse2, "sse2", 2, v2df, v2df_u, v2di)
+DEFINE_JACOBI_KERNEL(jacobi_sweep_avx2, "avx2", 4, v4df, v4df_u, v4di)
+DEFINE_JACOBI_KERNEL(jacobi_sweep_avx512, "avx512f", 8, v8df, v8df_u, v8di)
+#endif
+
+/*
+ * Interleaved kernels.
+ *
+ * A batch of GS_KERNEL_BATCH_LANES problems of the same size is stored
+ * interleaved element by element, so that a vector holds the same
+ * point of every problem. The plain lexicographic loop then runs on
+ * whole vectors, and every lane sees exactly the operations
+ * sweep_scalar() does on its problem, with its error summed in the
+ * same order. Lanes that aren't active pass their values through
+ * unchanged. Unlike the wavefront kernels, there is nothing to shuffle,
+ * but the loop is as serial as the scalar one, just GS_KERNEL_BATCH_LANES
+ * problems wide.
+ *
+ * A point is handled as GS_KERNEL_BATCH_LANES / V vectors of the
+ * native width, GCC spills wider vectors to the stack. The generic
+ * one is compiled for the baseline of any architecture.
+ */
+#define BATCH_LANES GS_KERNEL_BATCH_LANES
+
+#define DEFINE_INTERLEAVED_KERNEL(NAME, ATTRIBUTES, V, VDF, VDI)         \
+static void ATTRIBUTES                                                   \
+NAME(double *matrix, int width, int r0, int r1, int c0, int c1,          \
+     const int *active, double *error)                                   \
+{                                                                        \
+        enum { N = BATCH_LANES / V };                                    \
+        VDF *m = (VDF *)matrix;                                          \
+        const VDI abs_mask = (VDI){ 0 } + 0x7fffffffffffffffLL;          \
+        VDI mask[N];                                                     \
+        VDF acc[N];                                                      \
+                                                                         \
+        for (int p = 0; p < BATCH_LANES; p++) {                          \
+                mask[p / V][p % V] = active[p] ? -1 : 0;                 \
+                acc[p / V][p % V] = error[p];                            \
+        }                                                                \
+                                                                         \
+        for (int i = r0; i < r1; i++) {                                  \
+                VDF west[N];                                             \
+                                                                         \
+                for (int h = 0; h < N; h++)                              \
+                        west[h] = m[INDEX(i, c0 - 1) * N + h];           \
+                                                                         \
+                for (int j = c0; j < c1; j++) {                          \
+                        for (int h = 0; h < N; h++) {                    \
+                                VDF old = m[INDEX(i, j) * N + h];        \
+                                VDF new_value = 0.25 * (                 \
+                                        m[INDEX(i + 1, j) * N + h] +     \
+                                        m[INDEX(i - 1, j) * N + h] +     \
+                                        m[INDEX(i, j + 1) * N + h] +     \
+                                        west[h]);                        \
+                                                                         \
+                                acc[h] += (VDF)((VDI)(old - new_value) & \
+                                                abs_mask & mask[h]);     \
+                                west[h] = (VDF)(                         \
+                                        ((VDI)new_value & mask[h]) |     \
+                                        ((VDI)old & ~mask[h]));          \
+                                m[INDEX(i, j) * N + h] = west[h];        \
+                        }                                                \
+                }                                                        \
+        }                                                                \
+                                                                         \
+        for (int p = 0; p < BATCH_LANES; p++)                            \
+                error[p] = acc[p / V][p % V];                            \
+}
+
+DEFINE_INTERLEAVED_KERNEL(interleaved_generic, , 2, v2df, v2di)
+#ifdef HAVE_X86_KERNELS
+DEFINE_INTERLEAVED_KERNEL(interleaved_avx2, __attribute__((target("avx2"))),
+                          4, v4df, v4di)
+DEFINE_INTERLEAVED_KERNEL(interleaved_avx512,
+                          __attribute__((target("avx512f"))), 8, v8df, v8di)
+#endif
+
+/**
+ * Available kernels, in the order "auto" tries them. The AVX-512
+ * kernel is only used on request: its error chain is twice as long
+ * per step, and with the lower clock zmm code runs at on many Xeons it
+ * was slower than the AVX2 kernel on the machines we measured. So is
+ * the SSE2 kernel, which is there for CPUs without AVX2: two lanes
+ * don't pay for the shuffles, and the scalar loop was faster.
+ *
+ * None of the kernels use FMA. The stencil has no multiply-add that
+ * could be contracted without changing the rounding, and the
+ * lexicographic kernels must match sweep_scalar() bit for bit.
+ */
+static const struct {
+        const char *name;
+        const char *cpu_feature;        /* NULL if always supported */
+        int is_auto;                    /* Candidate for "auto" */
+        kernel_t kernel;
+        rb_kernel_t rb_kernel;
+        interleaved_kernel_t interleaved_kernel;
+        jacobi_kernel_t jacobi_kernel;
+        rb_split_kernel_t rb_split_kernel;
+} kernels[] = {
+#ifdef HAVE_X86_KERNELS
+        { "avx2", "avx2", 1, sweep_avx2, rb_sweep_avx2, interleaved_avx2,
+          jacobi_sweep_avx2, rb_split_sweep_avx2 },
+        { "avx512", "avx512f", 0, sweep_avx512, rb_sweep_avx512,
+          interleaved_avx512, jacobi_sweep_avx512, rb_split_sweep_avx512 },
+        { "sse2", "sse2", 0, sweep_sse2, rb_sweep_sse2, interleaved_generic,
+          jacobi_sweep_sse2, rb_split_sweep_sse2 },
+#endif
+        { "scalar", NULL, 1, sweep_scalar, rb_sweep_scalar,
+          interleaved_generic, jacobi_sweep_scalar, rb_split_sweep_scalar },
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(*kernels))
+
+/* Selected kernel, index into kernels[] */
+static int selected = NKERNELS - 1;
+
+static int
+cpu_supports(const char *feature)
+{
+        if (!feature)
+                return 1;
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (!strcmp(feature, "avx512f"))
+                return __builtin_cpu_supports("avx512f");
+        if (!strcmp(feature, "avx2"))
+                return __builtin_cpu_supports("avx2");
+        if (!strcmp(feature, "sse2"))
+                return __builtin_cpu_supports("sse2");
+#endif
+        return 0;
+}
+
+int
+gs_kernel_select(const char *name)
+{
+        for (int k = 0; k < (int)NKERNELS; k++) {
+                if (strcmp(name, "auto") ? strcmp(name, kernels[k].name) :
+                    !kernels[k].is_auto)
+                        continue;
+                if (!cpu_supports(kernels[k].cpu_feature))
+                        continue;
+                selected = k;
+                return 0;
+        }
+        return -1;
+}
+
+const char *
+gs_kernel_name()
+{
+        return kernels[selected].name;
+}
+
+const char *
+gs_kernel_get(int index)
+{
+        for (int k = 0; k < (int)NKERNELS; k++) {
+                if (cpu_supports(kernels[k].cpu_feature) && index-- == 0)
+                        return kernels[k].name;
+        }
+        return NULL;
+}
+
+size_t
+gs_kernel_scratch_size(int ncols)
+{
+        /* Skewed values and errors of three strips, (ncols + V + 1) x V
+         * each */
+        return 6 * (size_t)(MAX(ncols, 0) + MAX_LANES + 1) * MAX_LANES;
+}
+
+double
+gs_kernel_sweep(double *matrix, int width, int r0, int r1, int c0, int c1,
+                double omega, double error, double *scratch)
+{
+        return kernels[selected].kernel(matrix, width, r0, r1, c0, c1,
+                                        omega, error, scratch);
+}
+
+void
+gs_kernel_blocking(int ncols, int panel_cols, int *block_rows,
+                   int *block_cols)
+{
+        size_t l2 = topology_cache_size(2);
+        /* Bytes per column the kernels keep live: their scratch space
+         * plus the rows of a strip and its halo */
+        size_t per_col = (gs_kernel_scratch_size(1) -
+                          gs_kernel_scratch_size(0) +
+                          MAX_LANES + 2) * sizeof(double);
+        int cols;
+
+        *block_rows = BLOCK_ROWS;
+        if (panel_cols != GS_KERNEL_PANELS_AUTO) {
+                *block_cols = MAX(panel_cols ? MIN(panel_cols, ncols) :
+                                  ncols, 1);
+                return;
+        }
+
+        if (!l2)
+                l2 = DEFAULT_L2_SIZE;
+
+        /* Leave half of L2 to the rows streaming through */
+        cols = l2 / 2 / per_col;
+        cols -= cols % BLOCK_COLS_ALIGN;
+
+        *block_cols = MAX(cols, BLOCK_COLS_ALIGN);
+        if (*block_cols >= ncols)
+                *block_cols = MAX(ncols, 1);
+}
+
+/**
+ * Count the lines of a working set of rows that don't fit in their
+ * cache set, with rows stride bytes apart and bytes long each. Only
+ * the address bits within a page map to the sets the same way every
+ * time. Above that, the sets are spread over the pages at random, so
+ * only a part of the cache the size of a page is modelled, with the
+ * ways of all the copies of it.
+ */
+static long
+set_conflicts(const struct topology_cache *cache, size_t page_size,
+              size_t stride, int rows, size_t bytes)
+{
+        const size_t line = cache->line_size;
+        size_t sets = cache->sets;
+        size_t ways = cache->ways;
+        int *count;
+        long excess = 0;
+
+        if (sets * line > page_size) {
+                ways *= sets * line / page_size;
+                sets = page_size / line;
+        }
+
+        count = calloc(sets, sizeof(*count));
+        if (!count)
+                return 0;
+        for (int k = 0; k < rows; k++) {
+                size_t first = k * stride / line;
+                size_t last = (k * stride + bytes - 1) / line;
+
+                for (size_t l = first; l <= last; l++) {
+                        if (++count[l % sets] > (int)ways)
+                                excess++;
+                }
+        }
+        free(count);
+
+        return excess;
+}
+
+int
+gs_kernel_padding(int size, size_t page_size)
+{
+        const int ncols = MAX(size - 2, 1);
+        struct topology_cache caches[MAX_CACHE_LEVEL];
+        int ncaches = 0, line = 64;
+        int block_rows, block_cols;
+        long best = -1;
+        int best_pad = 0;
+
+        for (int level = 1; level <= MAX_CACHE_LEVEL; level++) {
+                struct topology_cache *cache = &caches[ncaches];
+
+                if (topology_cache_info(level, cache) == 0 &&
+                    cache->line_size > 0 && cache->ways > 0 &&
+                    cache->sets > 0)
+                        ncaches++;
+        }
+        if (!ncaches)
+                return 0;
+        line = caches[0].line_size;
+
+        gs_kernel_blocking(ncols, 0, &block_rows, &block_cols);
+
+        /* Whole lines of padding, so that the rows stay aligned */
+        for (int lines = 0; lines <= MAX_PAD_LINES; lines++) {
+                const int pad = lines * line / sizeof(double);
+                const size_t stride = (size_t)(size + pad) * sizeof(double);
+                const size_t tile = (size_t)(block_cols + 2) * sizeof(double);
+                long excess = 0;
+
+                for (int c = 0; c < ncaches; c++) {
+                        /* The window of the rows a SIMD kernel
+                         * updates at once, and the strip of a blocked
+                         * sweep with its halo, in the caches they fit */
+                        if (caches[c].size >=
+                            (size_t)(MAX_LANES + 2) * WINDOW_LINES * line)
+                                excess += set_conflicts(
+                                        &caches[c], page_size, stride,
+                                        MAX_LANES + 2,
+                                        (size_t)WINDOW_LINES * line);
+                        if (caches[c].size >= (block_rows + 2) * tile)
+                                excess += set_conflicts(
+                                        &caches[c], page_size, stride,
+                                        block_rows + 2, tile);
+                }
+
+                if (best < 0 || excess < best) {
+                        best = excess;
+                        best_pad = pad;
+                }
+                if (!excess)
+                        break;
+        }
+
+        return best_pad;
+}
+
+double
+gs_kernel_sweep_blocked(double *matrix, int width, int r0, int r1,
+                        int c0, int c1, int block_rows, int block_cols,
+                        double omega, double error, double *scratch)
+{
+        for (int i = r0; i < r1; i += block_rows) {
+                for (int j = c0; j < c1; j += block_cols)
+                        error = kernels[selected].kernel(
+                                matrix, width,
+                                i, MIN(i + block_rows, r1),
+                                j, MIN(j + block_cols, c1),
+                                omega, error, scratch);
+        }
+
+        return error;
+}
+
+double
+gs_kernel_rb_sweep(double *matrix, int width, int r0, int r1, int c0, int c1,
+                   int colour, double omega, double error)
+{
+        return kernels[selected].rb_kernel(matrix, width, r0, r1, c0, c1,
+                                           colour, omega, error);
+}
+
+void
+gs_kernel_sweep_interleaved(double *matrix, int width, int r0, int r1,
+                            int c0, int c1, const int *active, double *error)
+{
+        kernels[selected].interleaved_kernel(matrix, width, r0, r1, c0, c1,
+                                             active, error);
+}
+
+double
+gs_kernel_rb_split_sweep(double *points, const double *others, int width,
+                         int r0, int r1, int c0, int c1, int colour,
+                         double omega, double error)
+{
+        return kernels[selected].rb_split_kernel(points, others, width,
+                                                 r0, r1, c0, c1, colour,
+                                                 omega, error);
+}
+
+double
+gs_kernel_jacobi_sweep(const double *src, double *dst, int width,
+                       int r0, int r1, int c0, int c1, double error)
+{
+        return kernels[selected].jacobi_kernel(src, dst, width,
+                                               r0, r1, c0, c1, error);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,207 @@
+/**
+ * Gauss-Seidel sweep kernels shared by the implementations.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#ifndef GS_KERNEL_H
+#define GS_KERNEL_H
+
+#include <stddef.h>
+
+/**
+ * Select the kernel used by gs_kernel_sweep().
+ *
+ * \param name "auto" for the fastest kernel supported by this CPU,
+ *             "scalar" for the plain lexicographic loop, or "sse2",
+ *             "avx2" or "avx512" for the SIMD kernels. The CPU is
+ *             checked at runtime, so one binary runs on all of them.
+ * \return 0 on success, -1 if the kernel is unknown or not supported
+ *         by this CPU.
+ */
+extern int gs_kernel_select(const char *name);
+
+/**
+ * Get the name of the selected kernel.
+ */
+extern const char *gs_kernel_name();
+
+/**
+ * Get a kernel supported by this CPU.
+ *
+ * \param index Index of the kernel among the supported ones, in the
+ *              order "auto" tries them
+ * \return Name of the kernel, or NULL if index is past the last one
+ */
+extern const char *gs_kernel_get(int index);
+
+/**
+ * Get the number of doubles of scratch space gs_kernel_sweep() needs
+ * for a block ncols wide. The scratch space must be aligned to 64
+ * bytes.
+ */
+extern size_t gs_kernel_scratch_size(int ncols);
+
+/**
+ * Run one Gauss-Seidel sweep over rows [r0, r1) and columns [c0, c1)
+ * of a matrix with rows of width elements. The block is updated in
+ * lexicographic order, and the error of every point is added to error
+ * in that same order, so the results are bit-identical whichever
+ * kernel is selected.
+ *
+ * \param omega Over-relaxation factor, 1.0 for plain Gauss-Seidel. A
+ *              point moves to old + omega * (new - old).
+ * \param error Error accumulated so far
+ * \param scratch Scratch space, see gs_kernel_scratch_size()
+ * \return error plus the error of the block
+ */
+extern double gs_kernel_sweep(double *matrix, int width,
+                              int r0, int r1, int c0, int c1,
+                              double omega, double error, double *scratch);
+
+/** Panel width asking gs_kernel_blocking() to fit the panels in cache */
+#define GS_KERNEL_PANELS_AUTO -1
+
+/**
+ * Pick the blocking for gs_kernel_sweep_blocked(). Panels span the
+ * whole row unless panel_cols asks for narrower ones, so that the
+ * errors are summed lexicographically and the same on every machine.
+ *
+ * \param ncols Number of columns that will be swept
+ * \param panel_cols Width of the panels, 0 for whole rows, or
+ *                   GS_KERNEL_PANELS_AUTO to narrow them only where
+ *                   the row and the kernel's scratch space would crowd
+ *                   out the L2 cache of this machine
+ * \param block_rows Height of the strips
+ * \param block_cols Width of the panels
+ */
+extern void gs_kernel_blocking(int ncols, int panel_cols,
+                               int *block_rows, int *block_cols);
+
+/**
+ * Pick the padding of a matrix of size x size elements, so that the
+ * rows the kernels work on at the same time don't compete for the
+ * same cache sets. Power of two rows map to the same sets otherwise.
+ * Tries up to 64 whole cache lines of padding, and returns the
+ * smallest that fits the working sets of gs_kernel_sweep_blocked()
+ * into the caches of this machine, or comes closest to.
+ *
+ * \param page_size Size of the pages backing the matrix. The mapping
+ *                  of addresses to cache sets is only known within a
+ *                  page.
+ * \return Padding in elements
+ */
+extern int gs_kernel_padding(int size, size_t page_size);
+
+/**
+ * Run one Gauss-Seidel sweep like gs_kernel_sweep(), but split the
+ * rows into strips of block_rows rows and every strip into panels of
+ * block_cols columns. The panels of a strip are swept left to right,
+ * each one top to bottom, so the neighbours above and below a point
+ * are in cache when it is updated, however wide the rows are.
+ *
+ * Every point still sees new values to its north and west and old
+ * values to its south and east, so the new matrix is the same as with
+ * gs_kernel_sweep(). The errors are summed in the order the points are
+ * visited, which is lexicographic only if a panel spans the whole row.
+ *
+ * \param scratch Scratch space, see gs_kernel_scratch_size(), for a
+ *                block block_cols wide
+ * \return error plus the error of the block
+ */
+extern double gs_kernel_sweep_blocked(double *matrix, int width,
+                                      int r0, int r1, int c0, int c1,
+                                      int block_rows, int block_cols,
+                                      double omega, double error,
+                                      double *scratch);
+
+/** Colours of the red-black ordering, point (i, j) is GS_RED if i + j is even */
+enum gs_colour {
+        GS_RED,
+        GS_BLACK,
+};
+
+/**
+ * Run one red-black half sweep, updating the points of one colour in
+ * rows [r0, r1) and columns [c0, c1). The points of a colour don't
+ * depend on each other, so the new matrix is the same whichever kernel
+ * is selected. The order the errors are summed in isn't, so the error
+ * may differ in the last bits.
+ *
+ * \param colour Colour to update, see enum gs_colour
+ * \param omega Over-relaxation factor, see gs_kernel_sweep()
+ * \param error Error accumulated so far
+ * \return error plus the error of the updated points
+ */
+extern double gs_kernel_rb_sweep(double *matrix, int width,
+                                 int r0, int r1, int c0, int c1,
+                                 int colour, double omega, double error);
+
+/**
+ * Run one red-black half sweep like gs_kernel_rb_sweep(), on a matrix
+ * with the points of each colour stored apart, row by row with rows of
+ * width elements. Column j of row i is element j / 2 of that row in the
+ * array of its colour. The points of a colour are then next to each
+ * other, and so are their neighbours: those of element k are element k
+ * of the rows above and below and elements k - 1 + s and k + s of the
+ * same row in the other array, where s is the parity of the columns of
+ * the colour in row i. The new matrix is the same as that of
+ * gs_kernel_rb_sweep(), the error may differ in the last bits.
+ *
+ * \param points Array of the colour to update
+ * \param others Array of the other colour
+ * \param c0 First column of the matrix to update
+ * \param c1 Column of the matrix to stop at
+ * \return error plus the error of the updated points
+ */
+extern double gs_kernel_rb_split_sweep(double *points, const double *others,
+                                       int width, int r0, int r1,
+                                       int c0, int c1, int colour,
+                                       double omega, double error);
+
+/**
+ * Run one Jacobi sweep over rows [r0, r1) and columns [c0, c1),
+ * computing every point of dst from its neighbours in src. The points
+ * don't depend on each other, so the new values are the same whichever
+ * kernel is selected. The error may differ in the last bits.
+ *
+ * \param error Error accumulated so far
+ * \return error plus the error of the block
+ */
+extern double gs_kernel_jacobi_sweep(const double *src, double *dst,
+                                     int width, int r0, int r1,
+                                     int c0, int c1, double error);
+
+/** Number of problems in the interleaved layout */
+#define GS_KERNEL_BATCH_LANES 8
+
+/**
+ * Run one Gauss-Seidel sweep on GS_KERNEL_BATCH_LANES problems stored
+ * interleaved, element (i, j) of problem p at index
+ * (width * i + j) * GS_KERNEL_BATCH_LANES + p. The matrix must be
+ * aligned to 64 bytes.
+ *
+ * Every problem is updated and its error summed exactly like
+ * gs_kernel_sweep() does on its own, so the results are bit-identical
+ * to solving the problems one by one.
+ *
+ * \param active Lanes to update, the others are left unchanged
+ * \param error Error accumulated so far by each problem, the errors of
+ *              the active ones are added
+ */
+extern void gs_kernel_sweep_interleaved(double *matrix, int width,
+                                        int r0, int r1, int c0, int c1,
+                                        const int *active, double *error);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,224 @@
+/**
+ * Worker threads shared by the solver contexts.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gs_pool.h"
+#include "topology.h"
+
+/** A gang handed to the pool by gs_pool_run() */
+struct gang {
+        void (*fn)(void *, int);
+        void *arg;
+        int n;
+        unsigned char *taken;   /* Member ids that have been started */
+        int unstarted;          /* Members waiting for a worker */
+        int running;            /* Members on workers that haven't returned */
+        struct gang *next;
+};
+
+struct worker {
+        struct gs_pool *pool;
+        int index;              /* 1 to nworkers, 0 is the caller */
+        pthread_t thread;
+};
+
+struct gs_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t work;    /* Signals a started gang or shutdown */
+        pthread_cond_t changed; /* Signals free workers or returned members */
+        int nworkers;
+        int nidle;              /* Workers neither running nor promised */
+        unsigned next_ticket;   /* Gangs are started in ticket order */
+        unsigned serving;
+        struct gang *ready;     /* Started gangs with members to hand out */
+        int shutdown;
+        struct worker *workers;
+};
+
+/**
+ * Pick an id of a gang for a worker, preferably its own index.
+ */
+static int
+claim_id(struct gang *gang, int index)
+{
+        int id = index;
+
+        if (id >= gang->n || gang->taken[id]) {
+                for (id = 1; gang->taken[id]; id++)
+                        ;
+        }
+        gang->taken[id] = 1;
+
+        return id;
+}
+
+static void *
+worker_main(void *_self)
+{
+        struct worker *self = _self;
+        struct gs_pool *pool = self->pool;
+
+        topology_bind_thread(self->index);
+
+        pthread_mutex_lock(&pool->lock);
+        for (;;) {
+                struct gang *gang;
+                int id;
+
+                while (!pool->ready && !pool->shutdown)
+                        pthread_cond_wait(&pool->work, &pool->lock);
+                if (!pool->ready)
+                        break;
+
+                gang = pool->ready;
+                id = claim_id(gang, self->index);
+                if (--gang->unstarted == 0)
+                        pool->ready = gang->next;
+                pthread_mutex_unlock(&pool->lock);
+
+                gang->fn(gang->arg, id);
+
+                pthread_mutex_lock(&pool->lock);
+                gang->running--;
+                pool->nidle++;
+                pthread_cond_broadcast(&pool->changed);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        return NULL;
+}
+
+struct gs_pool *
+gs_pool_create(int nworkers)
+{
+        struct gs_pool *pool = calloc(1, sizeof(*pool));
+
+        if (!pool)
+                return NULL;
+        pool->workers = calloc(nworkers > 0 ? nworkers : 1,
+                               sizeof(*pool->workers));
+        if (!pool->workers) {
+                free(pool);
+                return NULL;
+        }
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->changed, NULL);
+        pool->nidle = 0;
+
+        for (int k = 0; k < nworkers; k++) {
+                struct worker *w = &pool->workers[k];
+
+                w->pool = pool;
+                w->index = k + 1;
+                if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+                        fprintf(stderr, "Error creating thread %d\n", k + 1);
+                        gs_pool_destroy(pool);
+                        return NULL;
+                }
+                pool->nworkers++;
+                pool->nidle++;
+        }
+
+        return pool;
+}
+
+void
+gs_pool_destroy(struct gs_pool *pool)
+{
+        if (!pool)
+                return;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+        for (int k = 0; k < pool->nworkers; k++)
+                pthread_join(pool->workers[k].thread, NULL);
+
+        pthread_cond_destroy(&pool->changed);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->workers);
+        free(pool);
+}
+
+int
+gs_pool_size(const struct gs_pool *pool)
+{
+        return pool ? pool->nworkers + 1 : 1;
+}
+
+void
+gs_pool_run(struct gs_pool *pool, int n, void (*fn)(void *arg, int id),
+            void *arg)
+{
+        struct gang gang = {
+                .fn = fn,
+                .arg = arg,
+                .n = n,
+                .unstarted = n - 1,
+                .running = n - 1,
+        };
+        unsigned ticket;
+
+        if (n <= 1) {
+                fn(arg, 0);
+                return;
+        }
+        if (n > gs_pool_size(pool)) {
+                fprintf(stderr, "Gang of %d threads doesn't fit the pool\n", n);
+                abort();
+        }
+
+        gang.taken = calloc(n, 1);
+        if (!gang.taken) {
+                fprintf(stderr, "Failed to allocate gang\n");
+                exit(EXIT_FAILURE);
+        }
+        gang.taken[0] = 1;
+
+        /* Wait for our turn and enough free workers, then promise them
+         * to the gang so that nobody else can take them */
+        pthread_mutex_lock(&pool->lock);
+        ticket = pool->next_ticket++;
+        while (pool->serving != ticket || pool->nidle < n - 1)
+                pthread_cond_wait(&pool->changed, &pool->lock);
+        pool->serving++;
+        pool->nidle -= n - 1;
+
+        struct gang **tail = &pool->ready;
+        while (*tail)
+                tail = &(*tail)->next;
+        *tail = &gang;
+        pthread_cond_broadcast(&pool->work);
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(arg, 0);
+
+        pthread_mutex_lock(&pool->lock);
+        while (gang.running > 0)
+                pthread_cond_wait(&pool->changed, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+
+        free(gang.taken);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,60 @@
+/**
+ * Worker threads shared by the solver contexts.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#ifndef GS_POOL_H
+#define GS_POOL_H
+
+struct gs_pool;
+
+/**
+ * Start a pool of nworkers threads. Worker k is bound to CPU k + 1 of
+ * the binding set with topology_set_binding(). CPU 0 is left for the
+ * thread that runs the gangs, which is not touched here; call
+ * topology_bind_thread(0) on it to bind it.
+ *
+ * \return The pool, or NULL if it couldn't be created
+ */
+extern struct gs_pool *gs_pool_create(int nworkers);
+
+/**
+ * Stop the workers of a pool and free it. No gang may be running.
+ */
+extern void gs_pool_destroy(struct gs_pool *pool);
+
+/**
+ * Get the largest gang a pool can run, its workers plus the caller.
+ */
+extern int gs_pool_size(const struct gs_pool *pool);
+
+/**
+ * Run fn(arg, id) for every id in [0, n) as a gang of n threads and
+ * wait for all of them to return. The calling thread runs id 0 and
+ * n - 1 workers the others.
+ *
+ * The members of a gang may wait for each other, so a gang is only
+ * started once n - 1 workers are free to run it all at once. Gangs
+ * from different threads are started in the order they were asked
+ * for. If a gang takes the whole pool, worker k always runs id k, so
+ * memory a member touched first stays local to it in the next gang.
+ *
+ * \param pool Pool to run on, n must not exceed gs_pool_size(pool).
+ *             May be NULL if n is 1.
+ */
+extern void gs_pool_run(struct gs_pool *pool, int n,
+                        void (*fn)(void *arg, int id), void *arg);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,401 @@
+/**
+ * Preconditioned conjugate gradient solver using pthreads.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ * Solves the same problem as the sweeps, 4 x(i, j) minus its four
+ * neighbours equal to zero on the interior, with the boundary of the
+ * matrix fixed. The matrix of that system is symmetric and positive
+ * definite, and is applied without ever being stored. The residual,
+ * search direction and the other vectors have the shape of the matrix,
+ * with a boundary of zeros.
+ *
+ * The preconditioner is symmetric Gauss-Seidel: a forward sweep from
+ * zero followed by a backward sweep, on the residual instead of a zero
+ * right-hand side. Every thread owns a band of rows and sweeps it as if
+ * the other bands were zero, so the bands are preconditioned without
+ * waiting for each other. The preconditioner stays symmetric, but
+ * depends on the number of threads, and so does the iteration count.
+ *
+ * Every vector operation is fused into a pass over a band with the
+ * others that can run at the same time, and each pass sums up its dot
+ * products on the way. An iteration is three passes, each followed by
+ * a barrier.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "gs_interface.h"
+
+/** Per thread state, one cache line each to avoid false sharing */
+struct cg_thread {
+        int row_start, row_end; /* Interior rows [row_start, row_end) */
+        double pq;              /* Dot product of p and q over the band */
+        double rz;              /* Dot product of r and z over the band */
+        double error;           /* Change of the solution in the band */
+} __attribute__((aligned(64)));
+
+struct cg_state {
+        struct gs_context *ctx;
+        struct cg_thread *threads;
+        pthread_barrier_t barrier;
+
+        /* Residual, preconditioned residual, search direction and the
+         * matrix applied to it */
+        double *r, *z, *p, *q;
+        struct gs_buffer mem[4];
+        /* A row of zeros, standing in for the rows of other bands */
+        double *zero;
+};
+
+/**
+ * Write to every page of a thread's band, so that a first touch NUMA
+ * policy places it on the thread's node. The vectors must start out as
+ * zero anyway, the values of the matrix are overwritten by
+ * gs_ctx_reset().
+ */
+static void
+thread_first_touch(void *_state, int tid)
+{
+        struct cg_state *st = _state;
+        struct gs_context *ctx = st->ctx;
+        struct cg_thread *self = &st->threads[tid];
+        int start = tid == 0 ? 0 : self->row_start;
+        int end = tid == ctx->params.nthreads - 1 ?
+                ctx->params.size : self->row_end;
+
+        for (int i = start; i < end; i++) {
+                for (int j = 0; j < ctx->width; j++) {
+                        const size_t k = GS_INDEX(ctx, i, j);
+
+                        ctx->matrix[k] = 0.0;
+                        st->r[k] = st->z[k] = st->p[k] = st->q[k] = 0.0;
+                }
+        }
+}
+
+/**
+ * Allocate a vector on the same pages as the matrix.
+ */
+static double *
+cg_alloc(const struct gs_context *ctx, struct gs_buffer *mem)
+{
+        size_t size = (size_t)ctx->params.size * ctx->width * sizeof(double);
+
+        if (gs_buffer_alloc(mem, size, ctx->params.pages,
+                            ctx->params.populate) != 0) {
+                fprintf(stderr, "Failed to allocate solver vectors\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return mem->addr;
+}
+
+static void
+cg_init(struct gs_context *ctx)
+{
+        const int nthreads = ctx->params.nthreads;
+        int interior = MAX(ctx->params.size - 2, 0);
+        struct cg_state *st;
+
+        gs_verbose_printf(ctx, "\t****  Initializing the environment ****\n");
+
+        st = calloc(1, sizeof(*st));
+        if (st)
+                st->threads = aligned_alloc(64, nthreads * sizeof(*st->threads));
+        if (!st || !st->threads) {
+                fprintf(stderr, "Failed to allocate thread info\n");
+                exit(EXIT_FAILURE);
+        }
+        st->ctx = ctx;
+        ctx->priv = st;
+
+        st->r = cg_alloc(ctx, &st->mem[0]);
+        st->z = cg_alloc(ctx, &st->mem[1]);
+        st->p = cg_alloc(ctx, &st->mem[2]);
+        st->q = cg_alloc(ctx, &st->mem[3]);
+        st->zero = calloc(ctx->width, sizeof(double));
+        if (!st->zero) {
+                fprintf(stderr, "Failed to allocate solver vectors\n");
+                exit(EXIT_FAILURE);
+        }
+
+        /* Deal out the interior rows in bands as equal as possible */
+        for (int t = 0; t < nthreads; t++) {
+                st->threads[t].row_start = 1 + (long)interior * t / nthreads;
+                st->threads[t].row_end = 1 + (long)interior * (t + 1) / nthreads;
+        }
+
+        if (pthread_barrier_init(&st->barrier, NULL, nthreads) != 0) {
+                fprintf(stderr, "Failed to initialize barrier\n");
+                exit(EXIT_FAILURE);
+        }
+
+        gs_pool_run(ctx->pool, nthreads, thread_first_touch, st);
+}
+
+static void
+cg_finish(struct gs_context *ctx)
+{
+        struct cg_state *st = ctx->priv;
+
+        gs_verbose_printf(ctx, "\t****  Cleaning environment ****\n");
+
+        pthread_barrier_destroy(&st->barrier);
+        for (int k = 0; k < 4; k++)
+                gs_buffer_free(&st->mem[k]);
+        free(st->zero);
+        free(st->threads);
+        free(st);
+        ctx->priv = NULL;
+}
+
+/**
+ * Forward Gauss-Seidel sweep over row i of a band, solving for z with
+ * the residual as the right-hand side. The sweep starts from zero, so
+ * the points to the east and south don't contribute yet.
+ */
+static void
+forward_row(const struct cg_state *st, int i, int row_start)
+{
+        const struct gs_context *ctx = st->ctx;
+        const int n = ctx->params.size;
+        const double *r = &st->r[GS_INDEX(ctx, i, 0)];
+        const double *north = i > row_start ?
+                &st->z[GS_INDEX(ctx, i - 1, 0)] : st->zero;
+        double *z = &st->z[GS_INDEX(ctx, i, 0)];
+
+        for (int j = 1; j < n - 1; j++)
+                z[j] = 0.25 * (r[j] + north[j] + z[j - 1]);
+}
+
+/**
+ * Backward Gauss-Seidel sweep over row i of a band, following
+ * forward_row().
+ *
+ * \return Dot product of r and the new z over the row
+ */
+static double
+backward_row(const struct cg_state *st, int i, int row_start, int row_end)
+{
+        const struct gs_context *ctx = st->ctx;
+        const int n = ctx->params.size;
+        const double *r = &st->r[GS_INDEX(ctx, i, 0)];
+        const double *north = i > row_start ?
+                &st->z[GS_INDEX(ctx, i - 1, 0)] : st->zero;
+        const double *south = i < row_end - 1 ?
+                &st->z[GS_INDEX(ctx, i + 1, 0)] : st->zero;
+        double *z = &st->z[GS_INDEX(ctx, i, 0)];
+        double rz = 0.0;
+
+        for (int j = n - 2; j >= 1; j--) {
+                z[j] = 0.25 * (r[j] + north[j] + south[j] +
+                               z[j - 1] + z[j + 1]);
+                rz += r[j] * z[j];
+        }
+
+        return rz;
+}
+
+/**
+ * Compute the residual of the band and precondition it.
+ *
+ * \return Dot product of r and z over the band
+ */
+static double
+band_start(struct cg_state *st, const struct cg_thread *self)
+{
+        const struct gs_context *ctx = st->ctx;
+        const int n = ctx->params.size;
+        const double *x = ctx->matrix;
+        double rz = 0.0;
+
+        for (int i = self->row_start; i < self->row_end; i++) {
+                for (int j = 1; j < n - 1; j++)
+                        st->r[GS_INDEX(ctx, i, j)] =
+                                x[GS_INDEX(ctx, i + 1, j)] +
+                                x[GS_INDEX(ctx, i - 1, j)] +
+                                x[GS_INDEX(ctx, i, j + 1)] +
+                                x[GS_INDEX(ctx, i, j - 1)] -
+                                4.0 * x[GS_INDEX(ctx, i, j)];
+                forward_row(st, i, self->row_start);
+        }
+        for (int i = self->row_end - 1; i >= self->row_start; i--)
+                rz += backward_row(st, i, self->row_start, self->row_end);
+
+        return rz;
+}
+
+/**
+ * Update the search direction of the band to p = z + beta p.
+ */
+static void
+band_direction(struct cg_state *st, const struct cg_thread *self,
+               double beta)
+{
+        const struct gs_context *ctx = st->ctx;
+        const int n = ctx->params.size;
+
+        for (int i = self->row_start; i < self->row_end; i++) {
+                for (int j = 1; j < n - 1; j++) {
+                        const size_t k = GS_INDEX(ctx, i, j);
+
+                        st->p[k] = st->z[k] + beta * st->p[k];
+                }
+        }
+}
+
+/**
+ * Apply the matrix to the search direction of the band, q = A p. Reads
+ * the rows next to the band, so every band must have updated p.
+ *
+ * \return Dot product of p and q over the band
+ */
+static double
+band_apply(struct cg_state *st, const struct cg_thread *self)
+{
+        const struct gs_context *ctx = st->ctx;
+        const int n = ctx->params.size;
+        const double *p = st->p;
+        double pq = 0.0;
+
+        for (int i = self->row_start; i < self->row_end; i++) {
+                for (int j = 1; j < n - 1; j++) {
+                        const size_t k = GS_INDEX(ctx, i, j);
+
+                        st->q[k] = 4.0 * p[k] -
+                                p[GS_INDEX(ctx, i + 1, j)] -
+                                p[GS_INDEX(ctx, i - 1, j)] -
+                                p[GS_INDEX(ctx, i, j + 1)] -
+                                p[GS_INDEX(ctx, i, j - 1)];
+                        pq += p[k] * st->q[k];
+                }
+        }
+
+        return pq;
+}
+
+/**
+ * Step along the search direction, x += alpha p and r -= alpha q, and
+ * precondition the new residual of the band. Every row is swept
+ * forward as soon as its residual is known.
+ *
+ * \param error Set to the change of the solution in the band, like the
+ *              error of a sweep
+ * \return Dot product of r and z over the band
+ */
+static double
+band_step(struct cg_state *st, const struct cg_thread *self, double alpha,
+          double *error)
+{
+        const struct gs_context *ctx = st->ctx;
+        const int n = ctx->params.size;
+        double *x = ctx->matrix;
+        double rz = 0.0, step = 0.0;
+
+        for (int i = self->row_start; i < self->row_end; i++) {
+                for (int j = 1; j < n - 1; j++) {
+                        const size_t k = GS_INDEX(ctx, i, j);
+
+                        x[k] += alpha * st->p[k];
+                        st->r[k] -= alpha * st->q[k];
+                        step += fabs(st->p[k]);
+                }
+                forward_row(st, i, self->row_start);
+        }
+        for (int i = self->row_end - 1; i >= self->row_start; i--)
+                rz += backward_row(st, i, self->row_start, self->row_end);
+
+        *error = fabs(alpha) * step;
+        return rz;
+}
+
+/**
+ * Body of the worker threads. The partial dot products are summed up
+ * by every thread in the same order after a barrier, so they all agree
+ * on alpha, beta and when to stop. Each partial is only written again
+ * after the next barrier, when everybody is done reading it.
+ */
+static void
+thread_compute(void *_state, int tid)
+{
+        struct cg_state *st = _state;
+        struct gs_context *ctx = st->ctx;
+        struct cg_thread *self = &st->threads[tid];
+        const int nthreads = ctx->params.nthreads;
+        const double tolerance = ctx->params.tolerance;
+        double error = tolerance + 1;
+        double rz = 0.0, beta = 0.0;
+        int iter;
+
+        self->rz = band_start(st, self);
+        pthread_barrier_wait(&st->barrier);
+        for (int t = 0; t < nthreads; t++)
+                rz += st->threads[t].rz;
+
+        for (iter = 0; iter < ctx->params.iterations && error > tolerance;
+             iter++) {
+                double pq = 0.0, rz_next = 0.0, alpha;
+
+                band_direction(st, self, beta);
+                pthread_barrier_wait(&st->barrier);
+
+                self->pq = band_apply(st, self);
+                pthread_barrier_wait(&st->barrier);
+                for (int t = 0; t < nthreads; t++)
+                        pq += st->threads[t].pq;
+
+                /* Nothing left to do once the residual is zero */
+                alpha = pq > 0.0 ? rz / pq : 0.0;
+                self->rz = band_step(st, self, alpha, &self->error);
+                pthread_barrier_wait(&st->barrier);
+
+                error = 0.0;
+                for (int t = 0; t < nthreads; t++) {
+                        error += st->threads[t].error;
+                        rz_next += st->threads[t].rz;
+                }
+                beta = rz > 0.0 ? rz_next / rz : 0.0;
+                rz = rz_next;
+
+                if (tid == 0)
+                        gs_verbose_printf(ctx, "Iteration: %i, Error: %f\n",
+                                          iter, error);
+        }
+
+        if (tid == 0) {
+                ctx->iterations = iter;
+                ctx->error = error;
+        }
+}
+
+static void
+cg_calculate(struct gs_context *ctx)
+{
+        gs_pool_run(ctx->pool, ctx->params.nthreads, thread_compute, ctx->priv);
+}
+
+static const struct gs_backend cg_backend = {
+        .name = "cg",
+        .description = "Conjugate gradients, symmetric Gauss-Seidel "
+                       "preconditioned",
+        .options = GS_OPT_THREADS,
+        .init = cg_init,
+        .calculate = cg_calculate,
+        .finish = cg_finish,
+};
+
+GS_REGISTER_BACKEND(cg_backend)
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,215 @@
+/**
+ * Parallel Jacobi implementation using pthreads.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ * A Jacobi sweep computes every point from the values of the previous
+ * sweep only, into a second buffer, and the two buffers swap roles
+ * after each sweep. Nothing within a sweep depends on anything else,
+ * so every thread sweeps its band of rows at full SIMD width, and the
+ * threads only meet at one barrier at the end of each sweep. In return
+ * it takes about twice as many sweeps as Gauss-Seidel to converge.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gs_interface.h"
+#include "gs_kernel.h"
+
+/** Per thread state, one cache line each to avoid false sharing */
+struct jacobi_thread {
+        int row_start, row_end; /* Interior rows [row_start, row_end) */
+        /* Error of this band in the last two sweeps, indexed by the
+         * parity of the sweep */
+        double error[2];
+} __attribute__((aligned(64)));
+
+struct jacobi_state {
+        struct gs_context *ctx;
+        struct jacobi_thread *threads;
+        pthread_barrier_t barrier;
+
+        /* Second buffer, swapped with the matrix after every sweep */
+        struct gs_buffer mem;
+        double *buffer;
+};
+
+/**
+ * Get the rows of the matrix thread tid owns, including the boundary
+ * rows for the first and last thread.
+ */
+static void
+thread_rows(const struct jacobi_state *st, int tid, int *start, int *end)
+{
+        const struct gs_context *ctx = st->ctx;
+
+        *start = tid == 0 ? 0 : st->threads[tid].row_start;
+        *end = tid == ctx->params.nthreads - 1 ?
+                ctx->params.size : st->threads[tid].row_end;
+}
+
+/**
+ * Write to every page of a thread's rows in both buffers, so that a
+ * first touch NUMA policy places them on the thread's node. The values
+ * are overwritten by gs_ctx_reset() and the copy at the start of every
+ * solve.
+ */
+static void
+thread_first_touch(void *_state, int tid)
+{
+        struct jacobi_state *st = _state;
+        struct gs_context *ctx = st->ctx;
+        int start, end;
+
+        thread_rows(st, tid, &start, &end);
+        for (int i = start; i < end; i++) {
+                for (int j = 0; j < ctx->width; j++) {
+                        ctx->matrix[GS_INDEX(ctx, i, j)] = 0.0;
+                        st->buffer[GS_INDEX(ctx, i, j)] = 0.0;
+                }
+        }
+}
+
+static void
+jacobi_init(struct gs_context *ctx)
+{
+        const int nthreads = ctx->params.nthreads;
+        int interior = MAX(ctx->params.size - 2, 0);
+        size_t size = (size_t)ctx->params.size * ctx->width * sizeof(double);
+        struct jacobi_state *st;
+
+        gs_verbose_printf(ctx, "\t****  Initializing the environment ****\n");
+
+        st = calloc(1, sizeof(*st));
+        if (st)
+                st->threads = aligned_alloc(64, nthreads * sizeof(*st->threads));
+        if (!st || !st->threads) {
+                fprintf(stderr, "Failed to allocate thread info\n");
+                exit(EXIT_FAILURE);
+        }
+        st->ctx = ctx;
+        ctx->priv = st;
+
+        /* On the same pages as the matrix, for a fair comparison */
+        if (gs_buffer_alloc(&st->mem, size, ctx->params.pages,
+                            ctx->params.populate) != 0) {
+                fprintf(stderr, "Failed to allocate second buffer\n");
+                exit(EXIT_FAILURE);
+        }
+        st->buffer = st->mem.addr;
+
+        /* Deal out the interior rows in bands as equal as possible */
+        for (int t = 0; t < nthreads; t++) {
+                st->threads[t].row_start = 1 + (long)interior * t / nthreads;
+                st->threads[t].row_end = 1 + (long)interior * (t + 1) / nthreads;
+        }
+
+        if (pthread_barrier_init(&st->barrier, NULL, nthreads) != 0) {
+                fprintf(stderr, "Failed to initialize barrier\n");
+                exit(EXIT_FAILURE);
+        }
+
+        gs_pool_run(ctx->pool, nthreads, thread_first_touch, st);
+}
+
+static void
+jacobi_finish(struct gs_context *ctx)
+{
+        struct jacobi_state *st = ctx->priv;
+
+        gs_verbose_printf(ctx, "\t****  Cleaning environment ****\n");
+
+        pthread_barrier_destroy(&st->barrier);
+        gs_buffer_free(&st->mem);
+        free(st->threads);
+        free(st);
+        ctx->priv = NULL;
+}
+
+/**
+ * Body of the worker threads. Sweep iter reads the matrix if iter is
+ * even and the buffer if it is odd, and writes the other one. Every
+ * thread sums up the errors of all bands in the same order after the
+ * barrier, so they all agree on when to stop. The errors are kept for
+ * two sweeps, so a thread may write those of the next sweep while the
+ * others are still reading the last ones.
+ */
+static void
+thread_compute(void *_state, int tid)
+{
+        struct jacobi_state *st = _state;
+        struct gs_context *ctx = st->ctx;
+        struct jacobi_thread *self = &st->threads[tid];
+        const int size = ctx->params.size;
+        const double tolerance = ctx->params.tolerance;
+        double *bufs[2] = { ctx->matrix, st->buffer };
+        double error = tolerance + 1;
+        int start, end, iter;
+
+        /* The buffer needs the boundary of the matrix, which may have
+         * changed since the last solve */
+        thread_rows(st, tid, &start, &end);
+        memcpy(&st->buffer[GS_INDEX(ctx, start, 0)],
+               &ctx->matrix[GS_INDEX(ctx, start, 0)],
+               (size_t)(end - start) * ctx->width * sizeof(double));
+        pthread_barrier_wait(&st->barrier);
+
+        for (iter = 0; iter < ctx->params.iterations && error > tolerance;
+             iter++) {
+                self->error[iter & 1] = gs_kernel_jacobi_sweep(
+                        bufs[iter & 1], bufs[~iter & 1], ctx->width,
+                        self->row_start, self->row_end, 1, size - 1, 0.0);
+                pthread_barrier_wait(&st->barrier);
+
+                error = 0.0;
+                for (int t = 0; t < ctx->params.nthreads; t++)
+                        error += st->threads[t].error[iter & 1];
+
+                if (tid == 0)
+                        gs_verbose_printf(ctx, "Iteration: %i, Error: %f\n",
+                                          iter, error);
+        }
+
+        /* After an odd number of sweeps the solution is in the buffer.
+         * Nobody reads the band of another thread any more. */
+        if (iter & 1)
+                memcpy(&ctx->matrix[GS_INDEX(ctx, self->row_start, 0)],
+                       &st->buffer[GS_INDEX(ctx, self->row_start, 0)],
+                       (size_t)(self->row_end - self->row_start) *
+                       ctx->width * sizeof(double));
+
+        if (tid == 0) {
+                ctx->iterations = iter;
+                ctx->error = error;
+        }
+}
+
+static void
+jacobi_calculate(struct gs_context *ctx)
+{
+        gs_pool_run(ctx->pool, ctx->params.nthreads, thread_compute, ctx->priv);
+}
+
+static const struct gs_backend jacobi_backend = {
+        .name = "jacobi",
+        .description = "Double buffered Jacobi sweeps on threads",
+        .options = GS_OPT_THREADS,
+        .init = jacobi_init,
+        .calculate = jacobi_calculate,
+        .finish = jacobi_finish,
+};
+
+GS_REGISTER_BACKEND(jacobi_backend)
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
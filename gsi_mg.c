@@ -0,0 +1,440 @@
+/**
+ * Geometric multigrid solver, with Gauss-Seidel sweeps as the smoother.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ * The sweeps only damp the error quickly where it oscillates from one
+ * point to the next. Smooth error is left to a hierarchy of coarser
+ * grids, each with about half the points per side, where it oscillates
+ * again. A cycle smooths, moves the residual down to the next grid,
+ * solves for a correction there the same way and adds it back. Every
+ * cycle reduces the error by a fixed factor whatever the grid size, so
+ * the work to reach a tolerance grows linearly with the number of
+ * points.
+ *
+ * A grid of n points per side is coarsened to n / 2 + 1 points spanning
+ * the same square. The points of a grid of 2^k points don't lie on
+ * those of the coarser one, so the grids are coupled by bilinear
+ * interpolation rather than by injection. From 2^(k-1) + 1 points on,
+ * every other point is shared and the operators reduce to the usual
+ * ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gs_interface.h"
+#include "gs_kernel.h"
+
+/* Sweeps before and after every coarse grid correction */
+#define MG_PRE_SWEEPS 2
+#define MG_POST_SWEEPS 2
+
+/** One grid of the hierarchy, level 0 is the matrix of the context */
+struct mg_level {
+        int size;               /* Points per side, boundary included */
+        int width;              /* Elements per row */
+        /* Solution on level 0, and on every level while the first FMG
+         * cycle runs. Correction to the level above otherwise, zero on
+         * the boundary. */
+        double *u;
+        /* Right-hand side of the correction, scaled by the square of
+         * the spacing. NULL on level 0, which has none. */
+        double *f;
+
+        /* Point i of the level above lies in cell up_idx[i] of this
+         * one, at up_wt[i] from its first point */
+        int *up_idx;
+        double *up_wt;
+        /* Point i of this level lies in cell down_idx[i] of the level
+         * above, at down_wt[i] from its first point */
+        int *down_idx;
+        double *down_wt;
+
+        /* Cache blocking of a sweep, see gs_kernel_sweep_blocked() */
+        int block_rows, block_cols;
+};
+
+struct mg_state {
+        struct mg_level *levels;
+        int nlevels;
+
+        /* Scratch space for the sweep kernel, big enough for any level */
+        double *scratch;
+};
+
+/**
+ * Locate the n_from points of a grid in the cells of a grid of n_to
+ * points spanning the same square, along one side.
+ */
+static void
+map_points(int n_from, int n_to, int *idx, double *wt)
+{
+        for (int i = 0; i < n_from; i++) {
+                /* Position in units of the other grid's spacing, kept
+                 * exact as a fraction of n_from - 1 */
+                long pos = (long)i * (n_to - 1);
+                int cell = MIN(pos / (n_from - 1), n_to - 2);
+
+                idx[i] = cell;
+                wt[i] = (double)(pos - (long)cell * (n_from - 1)) /
+                        (n_from - 1);
+        }
+}
+
+static void *
+mg_alloc(size_t size)
+{
+        void *p = calloc(1, size);
+
+        if (!p) {
+                fprintf(stderr, "Failed to allocate multigrid levels\n");
+                exit(EXIT_FAILURE);
+        }
+
+        return p;
+}
+
+static void
+mg_init(struct gs_context *ctx)
+{
+        const int size = ctx->params.size;
+        struct mg_state *st;
+        size_t scratch = 0;
+
+        gs_verbose_printf(ctx, "\t****  Initializing the environment ****\n");
+
+        st = mg_alloc(sizeof(*st));
+        ctx->priv = st;
+
+        /* Down to a single interior point */
+        st->nlevels = 1;
+        for (int n = size; n > 3; n = n / 2 + 1)
+                st->nlevels++;
+        st->levels = mg_alloc(st->nlevels * sizeof(*st->levels));
+
+        for (int l = 0; l < st->nlevels; l++) {
+                struct mg_level *level = &st->levels[l];
+                size_t bytes;
+
+                if (l == 0) {
+                        level->size = size;
+                        level->width = ctx->width;
+                        level->u = ctx->matrix;
+                } else {
+                        const int n_up = st->levels[l - 1].size;
+
+                        level->size = n_up / 2 + 1;
+                        level->width = level->size;
+                        bytes = (size_t)level->size * level->size *
+                                sizeof(double);
+                        level->u = mg_alloc(bytes);
+                        level->f = mg_alloc(bytes);
+
+                        level->up_idx = mg_alloc(n_up * sizeof(int));
+                        level->up_wt = mg_alloc(n_up * sizeof(double));
+                        level->down_idx = mg_alloc(level->size * sizeof(int));
+                        level->down_wt = mg_alloc(level->size *
+                                                  sizeof(double));
+                        map_points(n_up, level->size,
+                                   level->up_idx, level->up_wt);
+                        map_points(level->size, n_up,
+                                   level->down_idx, level->down_wt);
+                }
+
+                gs_kernel_blocking(MAX(level->size - 2, 1), 0,
+                                   &level->block_rows, &level->block_cols);
+                scratch = MAX(scratch,
+                              gs_kernel_scratch_size(level->block_cols));
+        }
+        gs_verbose_printf(ctx, "Levels: %d, coarsest %d x %d points\n",
+                          st->nlevels, st->levels[st->nlevels - 1].size,
+                          st->levels[st->nlevels - 1].size);
+
+        /* aligned_alloc() wants a multiple of the alignment */
+        scratch = (scratch * sizeof(double) + 63) & ~(size_t)63;
+        st->scratch = aligned_alloc(64, scratch);
+        if (!st->scratch) {
+                fprintf(stderr, "Failed to allocate kernel scratch space\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void
+mg_finish(struct gs_context *ctx)
+{
+        struct mg_state *st = ctx->priv;
+
+        gs_verbose_printf(ctx, "\t****  Cleaning environment ****\n");
+
+        for (int l = 1; l < st->nlevels; l++) {
+                struct mg_level *level = &st->levels[l];
+
+                free(level->u);
+                free(level->f);
+                free(level->up_idx);
+                free(level->up_wt);
+                free(level->down_idx);
+                free(level->down_wt);
+        }
+        free(st->levels);
+        free(st->scratch);
+        free(st);
+        ctx->priv = NULL;
+}
+
+/**
+ * Run one Gauss-Seidel sweep over the interior of a level. Without a
+ * right-hand side this is the sweep of the other backends, run by the
+ * selected kernel. The corrections on the coarse levels have one, and
+ * are swept by a plain loop, they only take a third of the work.
+ *
+ * \param rhs 1 to solve for the correction in level->f
+ * \return Error of the sweep
+ */
+static double
+smooth(struct mg_state *st, int l, int rhs)
+{
+        struct mg_level *level = &st->levels[l];
+        const int n = level->size;
+        const size_t w = level->width;
+        double *u = level->u;
+        double error = 0.0;
+
+        if (!rhs)
+                return gs_kernel_sweep_blocked(u, w, 1, n - 1, 1, n - 1,
+                                               level->block_rows,
+                                               level->block_cols, 1.0, 0.0,
+                                               st->scratch);
+
+        for (int i = 1; i < n - 1; i++) {
+                for (int j = 1; j < n - 1; j++) {
+                        double new_value = 0.25 * (
+                                level->f[w * i + j] +
+                                u[w * (i + 1) + j] +
+                                u[w * (i - 1) + j] +
+                                u[w * i + j + 1] +
+                                u[w * i + j - 1]);
+
+                        error += fabs(u[w * i + j] - new_value);
+                        u[w * i + j] = new_value;
+                }
+        }
+
+        return error;
+}
+
+/**
+ * Move the residual of level l down to the right-hand side of level
+ * l + 1. Every fine point hands its residual to the corners of the
+ * coarse cell it lies in, with the weights it would be interpolated
+ * from them with. That is the transpose of the interpolation in
+ * prolong(), which makes up for the larger spacing on its own.
+ * Boundary points of the coarse grid get some too, but are never read.
+ */
+static void
+restrict_residual(struct mg_state *st, int l, int rhs)
+{
+        const struct mg_level *fine = &st->levels[l];
+        struct mg_level *coarse = &st->levels[l + 1];
+        const int n = fine->size;
+        const size_t w = fine->width, wc = coarse->width;
+        const double *u = fine->u;
+        double *f = coarse->f;
+
+        memset(f, 0, (size_t)coarse->size * wc * sizeof(double));
+
+        for (int i = 1; i < n - 1; i++) {
+                const int ci = coarse->up_idx[i];
+                const double ti = coarse->up_wt[i];
+                double *f0 = &f[wc * ci], *f1 = &f[wc * (ci + 1)];
+
+                for (int j = 1; j < n - 1; j++) {
+                        const int cj = coarse->up_idx[j];
+                        const double tj = coarse->up_wt[j];
+                        double r =
+                                u[w * (i + 1) + j] +
+                                u[w * (i - 1) + j] +
+                                u[w * i + j + 1] +
+                                u[w * i + j - 1] -
+                                4.0 * u[w * i + j];
+
+                        if (rhs)
+                                r += fine->f[w * i + j];
+                        f0[cj] += (1.0 - ti) * (1.0 - tj) * r;
+                        f0[cj + 1] += (1.0 - ti) * tj * r;
+                        f1[cj] += ti * (1.0 - tj) * r;
+                        f1[cj + 1] += ti * tj * r;
+                }
+        }
+}
+
+/**
+ * Interpolate level l + 1 bilinearly at the interior points of level l
+ * and add it to them, or store it with add set to 0.
+ */
+static void
+prolong(struct mg_state *st, int l, int add)
+{
+        struct mg_level *fine = &st->levels[l];
+        const struct mg_level *coarse = &st->levels[l + 1];
+        const int n = fine->size;
+        const size_t w = fine->width, wc = coarse->width;
+
+        for (int i = 1; i < n - 1; i++) {
+                const int ci = coarse->up_idx[i];
+                const double ti = coarse->up_wt[i];
+                const double *c0 = &coarse->u[wc * ci];
+                const double *c1 = &coarse->u[wc * (ci + 1)];
+                double *row = &fine->u[w * i];
+
+                for (int j = 1; j < n - 1; j++) {
+                        const int cj = coarse->up_idx[j];
+                        const double tj = coarse->up_wt[j];
+                        double value =
+                                (1.0 - ti) * ((1.0 - tj) * c0[cj] +
+                                              tj * c0[cj + 1]) +
+                                ti * ((1.0 - tj) * c1[cj] + tj * c1[cj + 1]);
+
+                        row[j] = add ? row[j] + value : value;
+                }
+        }
+}
+
+/**
+ * Sample level l bilinearly at every point of level l + 1. Gives the
+ * coarse grids the boundary of the problem for the first FMG cycle.
+ */
+static void
+sample(struct mg_state *st, int l)
+{
+        const struct mg_level *fine = &st->levels[l];
+        struct mg_level *coarse = &st->levels[l + 1];
+        const int n = coarse->size;
+        const size_t w = fine->width, wc = coarse->width;
+
+        for (int i = 0; i < n; i++) {
+                const int fi = coarse->down_idx[i];
+                const double ti = coarse->down_wt[i];
+                const double *f0 = &fine->u[w * fi];
+                const double *f1 = &fine->u[w * (fi + 1)];
+
+                for (int j = 0; j < n; j++) {
+                        const int fj = coarse->down_idx[j];
+                        const double tj = coarse->down_wt[j];
+
+                        coarse->u[wc * i + j] =
+                                (1.0 - ti) * ((1.0 - tj) * f0[fj] +
+                                              tj * f0[fj + 1]) +
+                                ti * ((1.0 - tj) * f1[fj] + tj * f1[fj + 1]);
+                }
+        }
+}
+
+/**
+ * Run one multigrid cycle on level l. The coarse grid correction is
+ * solved for by gamma cycles on level l + 1, one for a V-cycle and two
+ * for a W-cycle.
+ *
+ * \param rhs 1 if level l solves for a correction, see smooth()
+ * \return Error of the last sweep on level l
+ */
+static double
+cycle(struct mg_state *st, int l, int rhs, int gamma)
+{
+        struct mg_level *coarse = &st->levels[l + 1];
+        double error = 0.0;
+
+        /* One sweep solves a single interior point exactly */
+        if (l == st->nlevels - 1)
+                return smooth(st, l, rhs);
+
+        for (int k = 0; k < MG_PRE_SWEEPS; k++)
+                smooth(st, l, rhs);
+
+        restrict_residual(st, l, rhs);
+        memset(coarse->u, 0,
+               (size_t)coarse->size * coarse->width * sizeof(double));
+        for (int k = 0; k < gamma; k++)
+                cycle(st, l + 1, 1, gamma);
+        prolong(st, l, 1);
+
+        for (int k = 0; k < MG_POST_SWEEPS; k++)
+                error = smooth(st, l, rhs);
+
+        return error;
+}
+
+/**
+ * Full multigrid, the first cycle with -m fmg. The initial values are
+ * only used for the boundary. The problem is solved on the coarsest
+ * grid first, and the solution of every grid is interpolated to the
+ * next finer one as the starting point of a V-cycle there.
+ *
+ * \return Error of the last sweep on level 0
+ */
+static double
+full_multigrid(struct mg_state *st)
+{
+        double error = 0.0;
+
+        for (int l = 0; l < st->nlevels - 1; l++)
+                sample(st, l);
+        error = smooth(st, st->nlevels - 1, 0);
+
+        for (int l = st->nlevels - 2; l >= 0; l--) {
+                prolong(st, l, 0);
+                error = cycle(st, l, 0, 1);
+        }
+
+        return error;
+}
+
+/**
+ * Run cycles until the error of the last sweep on the finest grid is
+ * within the tolerance. Every cycle counts as one iteration.
+ */
+static void
+mg_calculate(struct gs_context *ctx)
+{
+        struct mg_state *st = ctx->priv;
+        const struct gs_params *p = &ctx->params;
+        const int gamma = p->cycle == GS_CYCLE_W ? 2 : 1;
+        double error = p->tolerance + 1;
+        int i;
+
+        for (i = 0; i < p->iterations && error > p->tolerance; i++) {
+                if (i == 0 && p->cycle == GS_CYCLE_FMG)
+                        error = full_multigrid(st);
+                else
+                        error = cycle(st, 0, 0, gamma);
+                gs_verbose_printf(ctx, "Iteration: %i, Error: %f\n",
+                                  i, error);
+        }
+
+        ctx->iterations = i;
+        ctx->error = error;
+}
+
+static const struct gs_backend mg_backend = {
+        .name = "mg",
+        .description = "Multigrid cycles, smoothed by sequential sweeps",
+        .options = GS_OPT_CYCLE,
+        .init = mg_init,
+        .calculate = mg_calculate,
+        .finish = mg_finish,
+};
+
+GS_REGISTER_BACKEND(mg_backend)
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
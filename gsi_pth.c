@@ -5,206 +5,661 @@
  * Course Part: Lab assignment 3
  */
 
+ #if defined(__linux__)
+ /* Needed for syscall(), which we use to get at futexes */
+ #define _DEFAULT_SOURCE
+ #endif
+
  #include <pthread.h>
+ #include <sched.h>
  #include <stdio.h>
  #include <stdlib.h>
+ #include <limits.h>
  #include <math.h>
  #include <stdatomic.h>                   // 1>For atomic operations
+ #if defined(__linux__)
+ #include <unistd.h>
+ #include <sys/syscall.h>
+ #include <linux/futex.h>
+ #endif
  
  #include "gs_interface.h"
+ #include "timing.h"
+ #include "topology.h"
+ #include "gs_kernel.h"
  
  /* 2> Define this to enable debug printing */
  #define DEBUG 0
  
  #if DEBUG
- #define dprintf(...) gs_verbose_printf(__VA_ARGS__)
+ #define dprintf(ctx, ...) gs_verbose_printf(ctx, __VA_ARGS__)
  #else
- #define dprintf(...) /* Don't print anything */
+ #define dprintf(ctx, ...) /* Don't print anything */
  #endif
  
- const int gsi_is_parallel = 1;
+ /*
+  * Limits used when picking the tile height automatically. A tile is
+  * published once, so its height is the number of rows between two
+  * progress updates seen by the neighbouring threads.
+  */
+ /* Working set budget of a tile */
+ #define TILE_CACHE_BUDGET (256 * 1024)
+ /* Minimum number of points per tile, amortizes one cache line handoff */
+ #define TILE_MIN_POINTS 4096
+ /* Minimum number of tile rows per thread, keeps pipeline fill short */
+ #define TILE_MIN_DEPTH 4
+ 
+ /* Number of polls before GS_WAIT_FUTEX goes to sleep */
+ #define WAIT_SPIN_LIMIT 256
+ /* Upper bound on the number of PAUSEs per poll for GS_WAIT_BACKOFF */
+ #define WAIT_BACKOFF_MAX 1024
+ 
+ /**
+  * Per-tile dependency counter. Each one sits on its own cache line
+  * since the four neighbouring tiles poll it.
+  */
+ typedef struct {
+     _Atomic int done;     /* Number of iterations completed on this tile, doubles as futex word */
+     _Atomic int waiters;  /* Threads sleeping on done, see GS_WAIT_FUTEX */
+     char padding[64 - 2 * sizeof(_Atomic int)];
+ } __attribute__((aligned(64))) tile_t;
+ 
+ /**
+  * Synchronization statistics, only updated by the owning thread.
+  */
+ typedef struct {
+     long published;       /* Tiles published to the neighbours */
+     long stalls;          /* Waits that didn't succeed on the first poll */
+     long polls;           /* Failed polls of another thread's cache line */
+     double wait_time;     /* Seconds spent in stalled waits */
+ } sync_stats_t;
+ 
+ typedef struct solve solve_t;
  
  /**
   * Thread information structure
   * Contains all the information needed by the worker threads
   */
  typedef struct {
+     solve_t *solve;       /* Solve this thread works on */
      int thread_id;        /* Thread ID */
-     pthread_t thread;     /* pthread handle */
-     double error;         /* Local error for this thread */
-     _Atomic int row_progress; /* 3> Progress counter for row synchronization */
+     int ntiles;           /* Number of tiles owned by this thread */
+     _Atomic double error; /* Running error of the iteration this thread is in */
+     _Atomic long progress; /* 3> Tiles completed so far in this solve, over all iterations */
+     sync_stats_t stats;   /* Synchronization statistics for the current solve */
+     double *scratch;      /* Scratch space for the sweep kernel */
      /* 4> Padding to prevent false sharing - ensure struct occupies a full cache line */
-     char padding[64 - (sizeof(int) + sizeof(pthread_t) + sizeof(double) + sizeof(_Atomic int)) % 64];
+     char padding[64 - (2 * sizeof(int) + sizeof(solve_t *) + sizeof(_Atomic double) + sizeof(_Atomic long) + sizeof(sync_stats_t) + sizeof(double *)) % 64];
  } __attribute__((aligned(64))) thread_info_t;
  
- /* Global variables */
- static thread_info_t *threads = NULL;
- static double global_error;
- static pthread_barrier_t iter_barrier;  // 5>barrier for thread synchronization
- static int final_iteration;            // 6>final iteration count
+ /**
+  * State of one solve, owned by its context
+  */
+ struct solve {
+     /* Event counter that thread 0 sleeps on while waiting for the error of
+      * an iteration. Workers only bump it when somebody is waiting. */
+     struct {
+         _Atomic int seq;
+         _Atomic int waiters;
+     } __attribute__((aligned(64))) gate;
+ 
+     struct gs_context *ctx;
+     int nthreads;                   /* Copies of the parameters used in the hot loops */
+     int wait_policy;
+     double tolerance;
+     thread_info_t *threads;
+     tile_t *tiles;
+     int tile_rows, tile_cols;       /* Size of a tile in elements */
+     int ntile_rows, ntile_cols;     /* Size of the tile grid */
+     int block_rows, block_cols;     /* Cache blocking within a tile */
+     double global_error;
+     int final_iteration;            // 6>final iteration count
+     _Atomic int stopped;            /* Raised by stop_solve() once the solve has converged */
+ };
+ 
+ static void thread_first_touch(void *_solve, int tid);
  
  /**
   * Initialize the thread information structures and other shared data.
   */
- void gsi_init() {
-     gs_verbose_printf("\t****  Initializing parallel environment ****\n");
+ static void pth_init(struct gs_context *ctx) {
+     const struct gs_params *p = &ctx->params;
+     const int nthreads = p->nthreads;
+     solve_t *solve;
+ 
+     gs_verbose_printf(ctx, "\t****  Initializing parallel environment ****\n");
+ 
+     solve = (solve_t *)aligned_alloc(64, (sizeof(solve_t) + 63) & ~(size_t)63);
+     if (!solve) {
+         fprintf(stderr, "Failed to allocate solver state\n");
+         exit(EXIT_FAILURE);
+     }
+     ctx->priv = solve;
+     solve->ctx = ctx;
+     solve->nthreads = nthreads;
+     solve->wait_policy = p->wait_policy;
+     solve->tolerance = p->tolerance;
  
      /* 7> Allocate and initialize thread info structures with cache line alignment to avoid false sharing */
-     threads = (thread_info_t *)aligned_alloc(64, gs_nthreads * sizeof(thread_info_t));
-     if (!threads) {
+     solve->threads = (thread_info_t *)aligned_alloc(64, nthreads * sizeof(thread_info_t));
+     if (!solve->threads) {
          fprintf(stderr, "Failed to allocate thread info\n");
          exit(EXIT_FAILURE);
      }
  
-     global_error = gs_tolerance + 1;
-     /* 8> Initialize global variables */
-     pthread_barrier_init(&iter_barrier, NULL, gs_nthreads);
-     final_iteration = gs_iterations;
+     /* 8> Initialize the shared counters */
+     atomic_init(&solve->gate.seq, 0);
+     atomic_init(&solve->gate.waiters, 0);
+     atomic_init(&solve->stopped, 0);
+ 
+     /* Split the interior into tiles. By default a tile column is as
+      * wide as one column strip per thread. The height fills
+      * TILE_CACHE_BUDGET, but is reduced to give every thread
+      * TILE_MIN_DEPTH tile rows and raised to TILE_MIN_POINTS so that
+      * publishing a tile doesn't cost more than computing it. Tiles are
+      * dealt out round-robin in row-major order so that we never run
+      * out of work for a thread. */
+     int interior_size = p->size - 2;  /* number of interior points in each dimension */
+     int tile_rows, tile_cols;
+     tile_cols = p->tile_cols ? p->tile_cols : (interior_size + nthreads - 1) / nthreads;
+     tile_cols = MAX(MIN(tile_cols, interior_size), 1);
+     if (p->tile_rows) {
+         tile_rows = p->tile_rows;
+     } else {
+         tile_rows = (int)(TILE_CACHE_BUDGET / ((tile_cols + 2) * sizeof(double))) - 2;
+         tile_rows = MIN(tile_rows, interior_size / (TILE_MIN_DEPTH * nthreads));
+         tile_rows = MAX(tile_rows, (TILE_MIN_POINTS + tile_cols - 1) / tile_cols);
+     }
+     tile_rows = MAX(MIN(tile_rows, interior_size), 1);
+     solve->tile_rows = tile_rows;
+     solve->tile_cols = tile_cols;
+     solve->ntile_rows = (interior_size + tile_rows - 1) / tile_rows;
+     solve->ntile_cols = (interior_size + tile_cols - 1) / tile_cols;
+     if (interior_size <= 0)
+         solve->ntile_rows = solve->ntile_cols = 0;
+     int ntiles = solve->ntile_rows * solve->ntile_cols;
+ 
+     solve->tiles = (tile_t *)aligned_alloc(64, MAX(ntiles, 1) * sizeof(tile_t));
+     if (!solve->tiles) {
+         fprintf(stderr, "Failed to allocate tile info\n");
+         exit(EXIT_FAILURE);
+     }
+     for (int b = 0; b < ntiles; b++) {
+         atomic_init(&solve->tiles[b].done, 0);
+         atomic_init(&solve->tiles[b].waiters, 0);
+     }
+ 
+     gs_verbose_printf(ctx, "Tiles: %d x %d elements, %d x %d tiles\n",
+                       tile_rows, tile_cols, solve->ntile_rows, solve->ntile_cols);
+ 
+     /* Wide tiles are only swept in panels on request */
+     gs_kernel_blocking(tile_cols, p->panel_cols, &solve->block_rows, &solve->block_cols);
+     gs_verbose_printf(ctx, "Blocks: %d x %d elements\n", solve->block_rows, solve->block_cols);
  
      /* 9> Initialize thread-specific data */
-     for (int i = 0; i < gs_nthreads; i++) {
-         threads[i].thread_id = i;
-         threads[i].error = 0.0;
-         atomic_init(&threads[i].row_progress, 0);
+     for (int i = 0; i < nthreads; i++) {
+         solve->threads[i].solve = solve;
+         solve->threads[i].thread_id = i;
+         solve->threads[i].ntiles = ntiles / nthreads + (i < ntiles % nthreads);
+         solve->threads[i].scratch = NULL;
+         atomic_init(&solve->threads[i].error, 0.0);
+         atomic_init(&solve->threads[i].progress, 0);
      }
-     
-     dprintf("\t****  Parallel environment initialized with %d threads ****\n", gs_nthreads);
+ 
+     /* Let every thread fault in the pages of its own tiles before the
+      * matrix is initialized, so they land on the thread's NUMA node.
+      * The threads come from the context's pool, which may be shared
+      * with other solves. */
+     gs_pool_run(ctx->pool, nthreads, thread_first_touch, solve);
+ 
+     dprintf(ctx, "\t****  Parallel environment initialized with %d threads ****\n", nthreads);
  }
  
  /**
   * Clean up the thread information structures and other shared data.
   */
- void gsi_finish() {
-     gs_verbose_printf("\t****  Cleaning parallel environment ****\n");
+ static void pth_finish(struct gs_context *ctx) {
+     solve_t *solve = (solve_t *)ctx->priv;
+ 
+     gs_verbose_printf(ctx, "\t****  Cleaning parallel environment ****\n");
+ 
      /* 10> destroyed or cleaned*/
-     pthread_barrier_destroy(&iter_barrier);
-     free(threads);
+     for (int t = 0; t < solve->nthreads; t++)
+         free(solve->threads[t].scratch);
+     free(solve->tiles);
+     free(solve->threads);
+     free(solve);
+     ctx->priv = NULL;
+ }
+ 
+ /**
+  * Tell the core that we are in a spin loop. On x86 this is PAUSE,
+  * which saves power and hands the pipeline to the sibling hyperthread.
+  */
+ static inline void cpu_relax() {
+ #if defined(__x86_64__) || defined(__i386__)
+     __builtin_ia32_pause();
+ #elif defined(__aarch64__)
+     __asm__ __volatile__("yield" ::: "memory");
+ #else
+     __asm__ __volatile__("" ::: "memory");
+ #endif
+ }
+ 
+ /**
+  * Sleep until *word no longer holds the value seen. Returns early on
+  * spurious wakeups, so callers must re-check their condition.
+  */
+ static void futex_wait(_Atomic int *word, int seen) {
+ #if defined(__linux__)
+     syscall(SYS_futex, (int *)word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+ #else
+     (void)word; (void)seen;
+     sched_yield();
+ #endif
+ }
+ 
+ /**
+  * Wake all threads sleeping in futex_wait() on word.
+  */
+ static void futex_wake(_Atomic int *word) {
+ #if defined(__linux__)
+     syscall(SYS_futex, (int *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+ #else
+     (void)word;
+ #endif
  }
  
  /**
-  * Performs a sweep of the Gauss-Seidel algorithm for a single thread.
-  * Each thread works on its own vertical chunk of the matrix.
-  * Threads synchronize using row_progress counters to ensure correct data dependencies.
+  * Back off after a failed poll, according to the wait policy.
+  *
+  * GS_WAIT_SPIN issues a single PAUSE. GS_WAIT_BACKOFF doubles the
+  * number of PAUSEs on every poll and starts yielding the core once it
+  * reaches WAIT_BACKOFF_MAX. GS_WAIT_FUTEX spins for WAIT_SPIN_LIMIT
+  * polls and then asks the caller to go to sleep.
+  *
+  * \param spins Number of failed polls so far, updated by this function
+  * \return 1 if the caller should sleep in futex_wait(), 0 otherwise
   */
- static void thread_sweep(int tid, int start_col, int end_col) {
+ static int wait_backoff(int policy, int *spins) {
+     int sleep = 0;
+ 
+     switch (policy) {
+     case GS_WAIT_SPIN:
+         cpu_relax();
+         break;
+ 
+     case GS_WAIT_BACKOFF:
+         for (int k = 0; k < MIN(1 << MIN(*spins, 30), WAIT_BACKOFF_MAX); k++)
+             cpu_relax();
+         if ((1 << MIN(*spins, 30)) >= WAIT_BACKOFF_MAX)
+             sched_yield();
+         break;
+ 
+     case GS_WAIT_FUTEX:
+         if (*spins < WAIT_SPIN_LIMIT)
+             cpu_relax();
+         else
+             sleep = 1;
+         break;
+     }
+ 
+     (*spins)++;
+     return sleep;
+ }
+ 
+ /**
+  * Wake the threads sleeping on word, if any registered. The caller
+  * has just published an update with a release store. Only sleepers
+  * need the stronger ordering, so the full fence is limited to
+  * GS_WAIT_FUTEX.
+  */
+ static inline void wake_waiters(int policy, _Atomic int *word, _Atomic int *waiters) {
+     if (policy != GS_WAIT_FUTEX)
+         return;
+     /* Order the update before the check for waiters, pairs with
+      * the registration in the waiter */
+     atomic_thread_fence(memory_order_seq_cst);
+     if (atomic_load_explicit(waiters, memory_order_relaxed))
+         futex_wake(word);
+ }
+ 
+ /**
+  * Wait until a neighbouring tile has completed the given number of
+  * iterations.
+  *
+  * \return 0 if the solve was stopped while waiting, 1 otherwise
+  */
+ static int wait_for_tile(thread_info_t *self, tile_t *tile, int iterations) {
+     int done = atomic_load_explicit(&tile->done, memory_order_acquire);
+     struct timespec ts;
+     int spins = 0;
+ 
+     /* Fast path, the tile is usually done by the time we need it. A
+      * stopped solve bumps every counter, so it has to be checked for
+      * whenever the tile looks done. */
+     if (done >= iterations &&
+         !atomic_load_explicit(&self->solve->stopped, memory_order_relaxed))
+         return 1;
+ 
+     timing_start(&ts);
+     for (;;) {
+         done = atomic_load_explicit(&tile->done, memory_order_acquire);
+         if (done >= iterations)
+             break;
+         if (wait_backoff(self->solve->wait_policy, &spins)) {
+             /* Register before the final check: either the producer
+              * sees us and wakes us up, or we see its update and the
+              * futex doesn't put us to sleep */
+             atomic_fetch_add(&tile->waiters, 1);
+             futex_wait(&tile->done, done);
+             atomic_fetch_sub(&tile->waiters, 1);
+         }
+     }
+     self->stats.stalls++;
+     self->stats.polls += spins;
+     self->stats.wait_time += timing_stop(&ts);
+ 
+     /* Acquiring a counter bumped by stop_solve() makes the flag visible */
+     return !atomic_load_explicit(&self->solve->stopped, memory_order_relaxed);
+ }
+ 
+ /**
+  * Raise the stop flag and wake anybody waiting for a tile. Only called
+  * once all tiles of the final iteration are done, so nobody is
+  * computing at this point. Every counter is bumped past the iteration
+  * its waiters need, which gets them out of the futex and, through the
+  * release, shows them the flag.
+  */
+ static void stop_solve(solve_t *solve) {
+     atomic_store_explicit(&solve->stopped, 1, memory_order_relaxed);
+     for (int b = 0; b < solve->ntile_rows * solve->ntile_cols; b++) {
+         atomic_fetch_add_explicit(&solve->tiles[b].done, 1, memory_order_release);
+         wake_waiters(solve->wait_policy, &solve->tiles[b].done, &solve->tiles[b].waiters);
+     }
+ }
+ 
+ /**
+  * Performs one Gauss-Seidel update of a single tile.
+  *
+  * There is no barrier between sweeps. Iteration iter of a tile only
+  * needs the new values of its north and west neighbours (same
+  * iteration) and the old values of its south and east neighbours
+  * (previous iteration). Waiting for all four also guarantees that
+  * each neighbour has read our values before we overwrite them, so the
+  * tiles flow from one iteration into the next as one continuous
+  * wavefront.
+  *
+  * \return Error of the tile, or -1 if the solve was stopped while waiting
+  */
+ static double tile_sweep(thread_info_t *self, int iter, int bi, int bj) {
+     solve_t *solve = self->solve;
+     struct gs_context *ctx = solve->ctx;
+     const int ntile_rows = solve->ntile_rows, ntile_cols = solve->ntile_cols;
+     tile_t *tile = &solve->tiles[bi * ntile_cols + bj];
+     double error = 0.0;
+ 
+     /* 11> Wait for the tiles above and to the left to finish this
+      * iteration, and the ones below and to the right to finish the
+      * previous one */
+     if ((bi > 0 && !wait_for_tile(self, tile - ntile_cols, iter + 1)) ||
+         (bj > 0 && !wait_for_tile(self, tile - 1, iter + 1)) ||
+         (bi < ntile_rows - 1 && !wait_for_tile(self, tile + ntile_cols, iter)) ||
+         (bj < ntile_cols - 1 && !wait_for_tile(self, tile + 1, iter)))
+         return -1;
+ 
+     /* We're iterating over interior points only, so tiles start at row/column 1 */
+     int start_row = 1 + bi * solve->tile_rows;
+     int end_row = MIN(start_row + solve->tile_rows, ctx->params.size - 1);
+     int start_col = 1 + bj * solve->tile_cols;
+     int end_col = MIN(start_col + solve->tile_cols, ctx->params.size - 1);
+ 
+     /* Update each point in our assigned area in place, in the same
+      * order and with the same rounding as the sequential version. An
+      * estimated omega was set before tile 0 of this iteration started,
+      * which we have waited for. */
+     error = gs_kernel_sweep_blocked(ctx->matrix, ctx->width, start_row, end_row,
+                                     start_col, end_col, solve->block_rows, solve->block_cols,
+                                     gs_ctx_omega(ctx), error, self->scratch);
+ 
+     /* 12> Signal that we've completed this tile. The release store
+      * makes our updates visible to whoever acquires the counter. */
+     atomic_store_explicit(&tile->done, iter + 1, memory_order_release);
+     wake_waiters(solve->wait_policy, &tile->done, &tile->waiters);
+     self->stats.published++;
+ 
+     return error;
+ }
+ 
+ /**
+  * Performs one sweep over the tiles owned by a single thread. Tile b
+  * (in row-major order) belongs to thread b % nthreads and every
+  * thread visits its tiles in increasing order. Since all dependencies
+  * point to tiles that come earlier in (iteration, row, column) order,
+  * the oldest unfinished tile can always run and nobody deadlocks.
+  *
+  * \return 0 if the solve was stopped while waiting, 1 otherwise
+  */
+ static int thread_sweep(thread_info_t *self, int iter) {
+     solve_t *solve = self->solve;
      double local_error = 0.0;
-     
-     /* We're iterating over interior points only, so we start at row 1 and end at (gs_size-2) */
-     for (int i = 1; i < gs_size - 1; i++) {
-         /*  11> Wait for the thread to the left to finish this row before we start */
-         if (tid > 0) {
-             while (atomic_load(&threads[tid - 1].row_progress) < i) {
-                 /* Short busy wait to reduce contention */
-                 for (volatile int k = 0; k < 10; k++);
+ 
+     for (int b = self->thread_id; b < solve->ntile_rows * solve->ntile_cols; b += solve->nthreads) {
+         double error = tile_sweep(self, iter, b / solve->ntile_cols, b % solve->ntile_cols);
+         if (error < 0)
+             return 0;
+ 
+         local_error += error;
+ 
+         /* Publish the running error, then count the tile as done */
+         atomic_store_explicit(&self->error, local_error, memory_order_relaxed);
+         atomic_fetch_add_explicit(&self->progress, 1, memory_order_release);
+         if (solve->wait_policy == GS_WAIT_FUTEX) {
+             atomic_thread_fence(memory_order_seq_cst);
+             if (atomic_load_explicit(&solve->gate.waiters, memory_order_relaxed)) {
+                 atomic_fetch_add_explicit(&solve->gate.seq, 1, memory_order_relaxed);
+                 futex_wake(&solve->gate.seq);
              }
          }
-         
-         /* Update each point in our assigned area */
-         for (int j = start_col; j < end_col; j++) {
-             /* Calculate new value using the standard stencil */
-             double new_value = 0.25 * (
-                 gs_matrix[GS_INDEX(i + 1, j)] +  /* Below (old value) */
-                 gs_matrix[GS_INDEX(i - 1, j)] +  /* Above (old value) */
-                 gs_matrix[GS_INDEX(i, j + 1)] +  /* Right (old value) */
-                 gs_matrix[GS_INDEX(i, j - 1)]    /* Left (new value if updated) */
-             );
-             
-             /* Calculate local error */
-             local_error += fabs(gs_matrix[GS_INDEX(i, j)] - new_value);
-             
-             /* 11> Update the matrix in-place with the new value */
-             gs_matrix[GS_INDEX(i, j)] = new_value;
+     }
+ 
+     return 1;
+ }
+ 
+ /**
+  * Decide whether another iteration is needed after iteration iter.
+  * Called by thread 0 once it has finished its own part of iter.
+  *
+  * The other threads may still be working on iter. Their running errors
+  * only grow, so as soon as the partial sum exceeds the tolerance we
+  * know that iter cannot converge and thread 0 moves on without draining
+  * the pipeline. Only when the partial sum is still within tolerance do
+  * we wait for the exact total. This makes the decision identical to
+  * summing the complete per-thread errors after a barrier. The sweeps
+  * that omega is estimated from and the last one, whose error goes to
+  * the caller, always wait for the exact total.
+  *
+  * \return 1 if another iteration is needed, 0 if the solution converged
+  */
+ static int need_next_iteration(thread_info_t *self, int iter) {
+     solve_t *solve = self->solve;
+     thread_info_t *threads = solve->threads;
+     struct timespec ts;
+     int spins = 0;
+     int registered = 0;
+     const int exact = gs_ctx_omega_wants(solve->ctx, iter) ||
+         iter == solve->ctx->params.iterations - 1;
+ 
+     timing_start(&ts);
+     for (;;) {
+         /* Sample the event counter before looking at the threads. Once
+          * we are registered as a waiter, any update we miss below
+          * bumps it and keeps us from sleeping. */
+         int seen = atomic_load_explicit(&solve->gate.seq, memory_order_acquire);
+         double error = 0.0;
+         int complete = 1;
+ 
+         for (int t = 0; t < solve->nthreads; t++) {
+             long progress = atomic_load_explicit(&threads[t].progress, memory_order_acquire);
+             /* Every tile of iteration iter + 1 depends on tile 0,
+              * which thread 0 owns. Thread t can therefore not be past
+              * iter, and once it has started iter its running error
+              * belongs to iter. */
+             if (progress > (long)iter * threads[t].ntiles)
+                 error += atomic_load_explicit(&threads[t].error, memory_order_relaxed);
+             if (progress < (long)(iter + 1) * threads[t].ntiles)
+                 complete = 0;
+         }
+ 
+         if ((error > solve->tolerance && !exact) || complete) {
+             if (registered)
+                 atomic_fetch_sub(&solve->gate.waiters, 1);
+             if (spins) {
+                 self->stats.stalls++;
+                 self->stats.polls += spins;
+                 self->stats.wait_time += timing_stop(&ts);
+             }
+             solve->global_error = error;
+             dprintf(solve->ctx, "Iteration: %i, Error: %s%f\n", iter, complete ? "" : ">", error);
+             if (exact)
+                 gs_ctx_omega_observe(solve->ctx, iter, error);
+             if (error > solve->tolerance)
+                 return 1;
+ 
+             solve->final_iteration = iter + 1;
+             stop_solve(solve);
+             return 0;
+         }
+ 
+         if (wait_backoff(solve->wait_policy, &spins)) {
+             if (registered) {
+                 futex_wait(&solve->gate.seq, seen);
+             } else {
+                 /* Take another look at the threads before sleeping */
+                 atomic_fetch_add(&solve->gate.waiters, 1);
+                 atomic_thread_fence(memory_order_seq_cst);
+                 registered = 1;
+             }
          }
-         
-         /* 12> Signal that we've completed processing this row */
-         atomic_store(&threads[tid].row_progress, i);
      }
-     
-     /* Store the local error in the thread's structure */
-     threads[tid].error = local_error;
  }
  
  /**
   * Main computation function for each thread.
   * This function is executed by each worker thread.
   */
- static void *thread_compute(void *_self) {
-     thread_info_t *self = (thread_info_t *)_self;
-     int tid = self->thread_id;
-     
-     /* 13> Calculate the column range for this thread */
-     int interior_size = gs_size - 2;  /* number of interior points in each dimension */
-     int points_per_thread = interior_size / gs_nthreads;
-     int start_col = 1 + tid * points_per_thread;
-     int end_col = (tid == gs_nthreads - 1) ? gs_size - 1 : start_col + points_per_thread;
-     
-     dprintf("Thread %d working on columns %d to %d\n", tid, start_col, end_col);
-     
+ static void thread_compute(void *_solve, int tid) {
+     solve_t *solve = (solve_t *)_solve;
+     thread_info_t *self = &solve->threads[tid];
+ 
+     dprintf(solve->ctx, "Thread %d working on %d tiles\n", tid, self->ntiles);
+ 
      /* Main iteration loop */
-     for (int iter = 0; iter < gs_iterations; iter++) {
-         /* 14> Reset progress indicators before starting a new iteration */
-         atomic_store(&threads[tid].row_progress, 0);
-         
-         /* 15> Synchronize all threads before starting a new iteration */
-         pthread_barrier_wait(&iter_barrier);
-         
-         /* Process this thread's part of the matrix */
-         thread_sweep(tid, start_col, end_col);
-         
-         /*16>  Wait for all threads to finish their sweep before accumulating errors */
-         pthread_barrier_wait(&iter_barrier);
-         
-         /*17> Thread 0 computes the global error and checks for convergence */
-         if (tid == 0) {
-             global_error = 0.0;
-             for (int t = 0; t < gs_nthreads; t++) {
-                 global_error += threads[t].error;
-             }
-             
-             dprintf("Iteration: %i, Error: %f\n", iter, global_error);
-             
-             /* Check for convergence */
-             if (global_error <= gs_tolerance) {
-                 final_iteration = iter + 1;
-                 /* We could break here, but we'll let all threads run for the specified iterations */
-             }
-         }
-         
-         /* Wait for error calculation before potentially starting next iteration */
-         pthread_barrier_wait(&iter_barrier);
+     for (int iter = 0; iter < solve->ctx->params.iterations; iter++) {
+         /* Process this thread's part of the matrix. Threads other than
+          * 0 leave here once the stop flag is raised. */
+         if (!thread_sweep(self, iter))
+             break;
+ 
+         /* 17> Thread 0 owns the first tile and so heads the wavefront,
+          * holding it back is enough to stop everybody after the
+          * converged iteration */
+         if (tid == 0 && !need_next_iteration(self, iter))
+             break;
      }
-     
-     return NULL;
  }
  
  /**
-  * Main entry point for the Gauss-Seidel calculation.
-  * Creates threads, starts the calculation, and waits for threads to finish.
-  */
- void gsi_calculate() {
-     gs_verbose_printf("\t****  Starting parallel Gauss-Seidel calculation ****\n");
-     
-     /* Create and start the worker threads */
-     for (int t = 0; t < gs_nthreads; t++) {
-         if (pthread_create(&threads[t].thread, NULL, thread_compute, &threads[t]) != 0) {
-             fprintf(stderr, "Error creating thread %d\n", t);
-             exit(EXIT_FAILURE);
+  * Write to every page of the tiles owned by a thread, so that a first
+  * touch NUMA policy places them on the thread's node. Tiles on the edge
+  * of the grid also take the boundary rows, columns and padding next to
+  * them. The values are overwritten by gs_ctx_reset() later. The kernel
+  * scratch space is allocated here for the same reason.
+  */
+ static void thread_first_touch(void *_solve, int tid) {
+     solve_t *solve = (solve_t *)_solve;
+     struct gs_context *ctx = solve->ctx;
+     thread_info_t *self = &solve->threads[tid];
+     const int ntile_rows = solve->ntile_rows, ntile_cols = solve->ntile_cols;
+     const int tile_rows = solve->tile_rows, tile_cols = solve->tile_cols;
+     size_t scratch_size = gs_kernel_scratch_size(solve->block_cols) * sizeof(double);
+ 
+     self->scratch = aligned_alloc(64, (scratch_size + 63) & ~(size_t)63);
+     if (!self->scratch) {
+         fprintf(stderr, "Failed to allocate kernel scratch space\n");
+         exit(EXIT_FAILURE);
+     }
+ 
+     for (int b = tid; b < ntile_rows * ntile_cols; b += solve->nthreads) {
+         int bi = b / ntile_cols, bj = b % ntile_cols;
+         int start_row = bi == 0 ? 0 : 1 + bi * tile_rows;
+         int end_row = bi == ntile_rows - 1 ? ctx->params.size : 1 + (bi + 1) * tile_rows;
+         int start_col = bj == 0 ? 0 : 1 + bj * tile_cols;
+         int end_col = bj == ntile_cols - 1 ? ctx->width : 1 + (bj + 1) * tile_cols;
+ 
+         for (int i = start_row; i < end_row; i++) {
+             for (int j = start_col; j < end_col; j++)
+                 ctx->matrix[GS_INDEX(ctx, i, j)] = 0.0;
          }
      }
-     
-     /* Wait for all threads to complete */
-     for (int t = 0; t < gs_nthreads; t++) {
-         pthread_join(threads[t].thread, NULL);
+ }
+ 
+ /**
+  * Main entry point for the Gauss-Seidel calculation.
+  * Runs thread_compute() on the pool, with the calling thread as worker 0.
+  */
+ static void pth_calculate(struct gs_context *ctx) {
+     solve_t *solve = (solve_t *)ctx->priv;
+     thread_info_t *threads = solve->threads;
+     const int nthreads = solve->nthreads;
+     const int ntiles = solve->ntile_rows * solve->ntile_cols;
+ 
+     gs_verbose_printf(ctx, "\t****  Starting parallel Gauss-Seidel calculation ****\n");
+ 
+     /* Reset the per-solve state; the context may already have run solves */
+     solve->global_error = solve->tolerance + 1;
+     solve->final_iteration = ctx->params.iterations;
+     for (int t = 0; t < nthreads; t++) {
+         atomic_store(&threads[t].error, 0.0);
+         atomic_store(&threads[t].progress, 0);
+         threads[t].stats = (sync_stats_t){ 0 };
      }
-     
-     /* Print convergence information */
-     if (global_error <= gs_tolerance) {
-         printf("Solution converged after %d iterations.\n", final_iteration);
-     } else {
-         printf("Reached maximum number of iterations. Solution did NOT converge.\n");
-         printf("Note: This is normal if you are using the default settings.\n");
+     for (int b = 0; b < ntiles; b++)
+         atomic_store(&solve->tiles[b].done, 0);
+     atomic_store(&solve->stopped, 0);
+ 
+     gs_pool_run(ctx->pool, nthreads, thread_compute, solve);
+ 
+     if (ctx->params.verbose) {
+         sync_stats_t total = { 0 };
+         for (int t = 0; t < nthreads; t++) {
+             total.published += threads[t].stats.published;
+             total.stalls += threads[t].stats.stalls;
+             total.polls += threads[t].stats.polls;
+             total.wait_time += threads[t].stats.wait_time;
+         }
+         /* Publishing every row of every strip is what the tiles replace */
+         long per_row = total.published / MAX(ntiles, 1) * (ctx->params.size - 2) * solve->ntile_cols;
+         gs_verbose_printf(ctx, "Synchronization: %ld tile publications (%ld with per-row publication)\n",
+                           total.published, per_row);
+         gs_verbose_printf(ctx, "Synchronization: %ld stalled waits, %ld failed polls, %f s waiting in total\n",
+                           total.stalls, total.polls, total.wait_time);
      }
-     
-     gs_verbose_printf("\t****  Parallel Gauss-Seidel calculation completed ****\n");
+ 
+     ctx->iterations = solve->final_iteration;
+     ctx->error = solve->global_error;
+ 
+     gs_verbose_printf(ctx, "\t****  Parallel Gauss-Seidel calculation completed ****\n");
  }
- 
\ No newline at end of file
+ 
+ static const struct gs_backend pth_backend = {
+     .name = "pth",
+     .description = "Lexicographic sweeps as a tiled wavefront on threads",
+     .options = GS_OPT_THREADS | GS_OPT_TILES | GS_OPT_WAIT | GS_OPT_PANELS |
+         GS_OPT_OMEGA,
+     .init = pth_init,
+     .calculate = pth_calculate,
+     .finish = pth_finish,
+ };
+ 
+ GS_REGISTER_BACKEND(pth_backend)
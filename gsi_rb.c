@@ -0,0 +1,211 @@
+/**
+ * Parallel red-black Gauss-Seidel implementation using pthreads.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ * Red-black ordering first updates every point (i, j) with i + j even
+ * and then every point with i + j odd. The neighbours of a point all
+ * have the other colour, so there are no dependencies within a half
+ * sweep. Every thread owns a band of rows and only has to meet the
+ * others at a barrier between the half sweeps. The result converges at
+ * the same asymptotic rate as lexicographic Gauss-Seidel, but isn't
+ * bit-identical to it.
+ *
+ * With the colours interleaved, a half sweep loads every cache line of
+ * the matrix and uses half of it. With -L redblack, each colour is
+ * stored in an array of its own, and a half sweep only reads the lines
+ * of the points it updates and of their neighbours.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gs_interface.h"
+#include "gs_kernel.h"
+
+/** Per thread state, one cache line each to avoid false sharing */
+struct rb_thread {
+        int row_start, row_end; /* Interior rows [row_start, row_end) */
+        double error;           /* Error of this band in the last sweep */
+} __attribute__((aligned(64)));
+
+struct rb_state {
+        struct gs_context *ctx;
+        struct rb_thread *threads;
+        pthread_barrier_t barrier;
+};
+
+/**
+ * Write to every page of a thread's band, so that a first touch NUMA
+ * policy places it on the thread's node. The first and last band also
+ * take the boundary rows. The values are overwritten by gs_ctx_reset().
+ */
+static void
+thread_first_touch(void *_state, int tid)
+{
+        struct rb_state *st = _state;
+        struct gs_context *ctx = st->ctx;
+        struct rb_thread *self = &st->threads[tid];
+        int start = tid == 0 ? 0 : self->row_start;
+        int end = tid == ctx->params.nthreads - 1 ?
+                ctx->params.size : self->row_end;
+
+        for (int i = start; i < end; i++) {
+                for (int j = 0; j < ctx->width; j++)
+                        ctx->matrix[GS_INDEX(ctx, i, j)] = 0.0;
+        }
+}
+
+static void
+rb_init(struct gs_context *ctx)
+{
+        const int nthreads = ctx->params.nthreads;
+        int interior = MAX(ctx->params.size - 2, 0);
+        struct rb_state *st;
+
+        gs_verbose_printf(ctx, "\t****  Initializing the environment ****\n");
+
+        st = calloc(1, sizeof(*st));
+        if (st)
+                st->threads = aligned_alloc(64, nthreads * sizeof(*st->threads));
+        if (!st || !st->threads) {
+                fprintf(stderr, "Failed to allocate thread info\n");
+                exit(EXIT_FAILURE);
+        }
+        st->ctx = ctx;
+        ctx->priv = st;
+
+        /* Deal out the interior rows in bands as equal as possible */
+        for (int t = 0; t < nthreads; t++) {
+                st->threads[t].row_start = 1 + (long)interior * t / nthreads;
+                st->threads[t].row_end = 1 + (long)interior * (t + 1) / nthreads;
+                st->threads[t].error = 0.0;
+        }
+
+        if (pthread_barrier_init(&st->barrier, NULL, nthreads) != 0) {
+                fprintf(stderr, "Failed to initialize barrier\n");
+                exit(EXIT_FAILURE);
+        }
+
+        gs_pool_run(ctx->pool, nthreads, thread_first_touch, st);
+}
+
+static void
+rb_finish(struct gs_context *ctx)
+{
+        struct rb_state *st = ctx->priv;
+
+        gs_verbose_printf(ctx, "\t****  Cleaning environment ****\n");
+
+        pthread_barrier_destroy(&st->barrier);
+        free(st->threads);
+        free(st);
+        ctx->priv = NULL;
+}
+
+/**
+ * Run a half sweep over the band of a thread, in the layout of the
+ * context.
+ */
+static double
+half_sweep(struct gs_context *ctx, const struct rb_thread *self, int colour,
+           double omega, double error)
+{
+        const int size = ctx->params.size;
+
+        if (ctx->params.layout == GS_LAYOUT_REDBLACK)
+                return gs_kernel_rb_split_sweep(
+                        ctx->matrix + gs_colour_base(ctx, colour),
+                        ctx->matrix + gs_colour_base(ctx, !colour),
+                        ctx->split_width, self->row_start, self->row_end,
+                        1, size - 1, colour, omega, error);
+
+        return gs_kernel_rb_sweep(ctx->matrix, ctx->width,
+                                  self->row_start, self->row_end,
+                                  1, size - 1, colour, omega, error);
+}
+
+/**
+ * Body of the worker threads. Every thread sums up the errors of all
+ * bands in the same order after the second barrier, so they all agree
+ * on when to stop without a third barrier. The errors of the next
+ * sweep are only written after the next barrier, when everybody is
+ * done reading. Only the sweeps omega is estimated from take a third
+ * one.
+ */
+static void
+thread_compute(void *_state, int tid)
+{
+        struct rb_state *st = _state;
+        struct gs_context *ctx = st->ctx;
+        struct rb_thread *self = &st->threads[tid];
+        const double tolerance = ctx->params.tolerance;
+        double error = tolerance + 1;
+        int iter;
+
+        for (iter = 0; iter < ctx->params.iterations && error > tolerance;
+             iter++) {
+                /* Both only change after the last barrier of an
+                 * iteration that wants its error */
+                const double omega = gs_ctx_omega(ctx);
+                const int wants_error = gs_ctx_omega_wants(ctx, iter);
+                double band_error;
+
+                band_error = half_sweep(ctx, self, GS_RED, omega, 0.0);
+                pthread_barrier_wait(&st->barrier);
+                band_error = half_sweep(ctx, self, GS_BLACK, omega,
+                                        band_error);
+                self->error = band_error;
+                pthread_barrier_wait(&st->barrier);
+
+                error = 0.0;
+                for (int t = 0; t < ctx->params.nthreads; t++)
+                        error += st->threads[t].error;
+
+                if (tid == 0)
+                        gs_verbose_printf(ctx, "Iteration: %i, Error: %f\n",
+                                          iter, error);
+
+                /* Nobody may start the next sweep before its omega has
+                 * been estimated */
+                if (wants_error) {
+                        if (tid == 0)
+                                gs_ctx_omega_observe(ctx, iter, error);
+                        pthread_barrier_wait(&st->barrier);
+                }
+        }
+
+        if (tid == 0) {
+                ctx->iterations = iter;
+                ctx->error = error;
+        }
+}
+
+static void
+rb_calculate(struct gs_context *ctx)
+{
+        gs_pool_run(ctx->pool, ctx->params.nthreads, thread_compute, ctx->priv);
+}
+
+static const struct gs_backend rb_backend = {
+        .name = "rb",
+        .description = "Red-black ordered sweeps on threads",
+        .options = GS_OPT_THREADS | GS_OPT_OMEGA,
+        .layouts = 1 << GS_LAYOUT_REDBLACK,
+        .init = rb_init,
+        .calculate = rb_calculate,
+        .finish = rb_finish,
+};
+
+GS_REGISTER_BACKEND(rb_backend)
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
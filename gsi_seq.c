@@ -15,77 +15,350 @@
 #include <math.h>
 
 #include "gs_interface.h"
+#include "gs_kernel.h"
 
-const int gsi_is_parallel = 0;
+struct seq_state {
+        /* Cache blocking of a sweep, see gs_kernel_sweep_blocked().
+         * Fused sweeps are skewed by blocks of block_rows rows as well,
+         * so that they visit the points in the same order. */
+        int block_rows, block_cols;
 
-void
-gsi_init()
+        /* Scratch space for the sweep kernel */
+        double *scratch;
+        /* Error of each sweep of a fused pass, NULL unless fusing */
+        double *fused_error;
+        /* Next block of each sweep of a fused pass, NULL unless fusing */
+        int *fused_next;
+};
+
+static void
+seq_init(struct gs_context *ctx)
 {
-        gs_verbose_printf("\t****  Initializing the environment ****\n");
+        const struct gs_params *p = &ctx->params;
+        struct seq_state *st;
+        size_t size;
+
+        gs_verbose_printf(ctx, "\t****  Initializing the environment ****\n");
+
+        st = calloc(1, sizeof(*st));
+        if (!st) {
+                fprintf(stderr, "Failed to allocate backend state\n");
+                exit(EXIT_FAILURE);
+        }
+        ctx->priv = st;
+
+        gs_kernel_blocking(p->size - 2, p->panel_cols,
+                           &st->block_rows, &st->block_cols);
+        /* The kernel runs on one tile at a time */
+        if (p->layout != GS_LAYOUT_ROWS)
+                st->block_cols = GS_TILE_SIZE;
+        gs_verbose_printf(ctx, "Blocks: %d x %d elements\n",
+                          st->block_rows, st->block_cols);
+
+        /* aligned_alloc() wants a multiple of the alignment */
+        size = gs_kernel_scratch_size(st->block_cols) * sizeof(double);
+        size = (size + 63) & ~(size_t)63;
+        st->scratch = aligned_alloc(64, size);
+        if (!st->scratch) {
+                fprintf(stderr, "Failed to allocate kernel scratch space\n");
+                exit(EXIT_FAILURE);
+        }
+
+        /* A pass never fuses more sweeps than the solve runs, the depth
+         * is up to the user and may be larger */
+        if (p->temporal_depth > 1) {
+                size_t depth = MIN(p->temporal_depth, p->iterations);
+
+                st->fused_error = malloc(depth * sizeof(double));
+                st->fused_next = malloc(depth * sizeof(int));
+                if (!st->fused_error || !st->fused_next) {
+                        fprintf(stderr, "Failed to allocate fused sweep state\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
 }
 
-void
-gsi_finish()
+static void
+seq_finish(struct gs_context *ctx)
 {
-        gs_verbose_printf("\t****  Cleaning environment ****\n");
+        struct seq_state *st = ctx->priv;
+
+        gs_verbose_printf(ctx, "\t****  Cleaning environment ****\n");
+
+        free(st->scratch);
+        free(st->fused_error);
+        free(st->fused_next);
+        free(st);
+        ctx->priv = NULL;
 }
 
+/** A tile of a tiled matrix and the tiles around it */
+struct tile_view {
+        double *tile, *north, *south, *west, *east;
+};
+
 /**
- * Computing routine for each element: That's a whole sweep
+ * Get element (i, j) of a tile, or of the tiles around it if i or j
+ * are just outside it.
+ */
+static inline double *
+tile_at(const struct tile_view *v, int i, int j)
+{
+        const int T = GS_TILE_SIZE;
+
+        if (i < 0)
+                return &v->north[(T - 1) * T + j];
+        if (i == T)
+                return &v->south[j];
+        if (j < 0)
+                return &v->west[i * T + T - 1];
+        if (j == T)
+                return &v->east[i * T];
+        return &v->tile[i * T + j];
+}
+
+/**
+ * Update element (i, j) of a tile exactly like the scalar kernel does.
+ */
+static double
+relax_point(const struct tile_view *v, int i, int j, double omega,
+            double error)
+{
+        double *point = tile_at(v, i, j);
+        double new_value = 0.25 * (
+                *tile_at(v, i + 1, j) +
+                *tile_at(v, i - 1, j) +
+                *tile_at(v, i, j + 1) +
+                *tile_at(v, i, j - 1));
+
+        if (omega != 1.0)
+                new_value = *point + omega * (new_value - *point);
+        error += fabs(*point - new_value);
+        *point = new_value;
+
+        return error;
+}
+
+/**
+ * Sweep a matrix stored in tiles, one tile after the other, row by row
+ * of tiles. The tiles above and to the left of a tile are done before
+ * it and those below and to the right after it, so every point still
+ * sees new values to its north and west and the new matrix is the same
+ * as that of a lexicographic sweep. The errors are summed tile by tile.
  *
- * \return Error size
+ * The kernel sweeps the points of a tile whose neighbours are all in
+ * the same tile, with the tile as the matrix. The edges of the tile
+ * have neighbours in other tiles and are updated one by one, the top
+ * row and the west column before the kernel runs and the east column
+ * and the bottom row after it.
  */
 static double
-sweep()
+sweep_tiles(struct gs_context *ctx, double omega)
 {
+        struct seq_state *st = ctx->priv;
+        const int size = ctx->params.size;
+        const int T = GS_TILE_SIZE;
+        double *m = ctx->matrix;
         double error = 0.0;
 
-        for (int i = 1; i < gs_size - 1; i++) {
-                for (int j = 1; j < gs_size - 1; j++) {
-                        double new_value = 0.25 * (
-                                gs_matrix[GS_INDEX(i + 1, j)] +
-                                gs_matrix[GS_INDEX(i - 1, j)] +
-                                gs_matrix[GS_INDEX(i, j + 1)] +
-                                gs_matrix[GS_INDEX(i, j - 1)]);
-
-                        /* Accumulate the solution error, we do this
-                         * while computing the new solution to avoid
-                         * having to store both the new and old
-                         * solution. Also avoids an additional
-                         * sweep. */
-                        error += fabs(gs_matrix[GS_INDEX(i, j)] - new_value);
-
-                        gs_matrix[GS_INDEX(i, j)] = new_value;
+        for (int tr = 0; tr < ctx->tiles; tr++) {
+                /* Rows of the tile to update, and those of them with
+                 * both neighbours in the tile, counted from the tile */
+                const int r0 = MAX(tr * T, 1) - tr * T;
+                const int r1 = MIN(tr * T + T, size - 1) - tr * T;
+                const int a0 = MAX(r0, 1), a1 = MIN(r1, T - 1);
+
+                for (int tc = 0; tc < ctx->tiles; tc++) {
+                        const int c0 = MAX(tc * T, 1) - tc * T;
+                        const int c1 = MIN(tc * T + T, size - 1) - tc * T;
+                        const int b0 = MAX(c0, 1), b1 = MIN(c1, T - 1);
+                        /* The tiles past the boundary are never read */
+                        const struct tile_view v = {
+                                .tile = m + gs_tile_base(ctx, tr, tc),
+                                .north = tr > 0 ?
+                                        m + gs_tile_base(ctx, tr - 1, tc) : NULL,
+                                .south = tr + 1 < ctx->tiles ?
+                                        m + gs_tile_base(ctx, tr + 1, tc) : NULL,
+                                .west = tc > 0 ?
+                                        m + gs_tile_base(ctx, tr, tc - 1) : NULL,
+                                .east = tc + 1 < ctx->tiles ?
+                                        m + gs_tile_base(ctx, tr, tc + 1) : NULL,
+                        };
+
+                        for (int j = c0; r0 < a0 && j < c1; j++)
+                                error = relax_point(&v, r0, j, omega, error);
+                        for (int i = a0; c0 < b0 && i < a1; i++)
+                                error = relax_point(&v, i, c0, omega, error);
+                        if (a0 < a1 && b0 < b1)
+                                error = gs_kernel_sweep(v.tile, T, a0, a1,
+                                                        b0, b1, omega, error,
+                                                        st->scratch);
+                        for (int i = a0; b1 < c1 && i < a1; i++)
+                                error = relax_point(&v, i, b1, omega, error);
+                        for (int j = c0; a1 < r1 && j < c1; j++)
+                                error = relax_point(&v, a1, j, omega, error);
                 }
         }
 
         return error;
 }
 
+/**
+ * Computing routine for each element: That's a whole sweep
+ *
+ * \param omega Over-relaxation factor, see gs_kernel_sweep()
+ * \return Error size
+ */
+static double
+sweep(struct gs_context *ctx, double omega)
+{
+        struct seq_state *st = ctx->priv;
+        const int size = ctx->params.size;
+
+        if (ctx->params.layout != GS_LAYOUT_ROWS)
+                return sweep_tiles(ctx, omega);
+
+        /* The kernel accumulates the solution error while computing
+         * the new solution to avoid having to store both the new and
+         * old solution. Also avoids an additional sweep. */
+        return gs_kernel_sweep_blocked(ctx->matrix, ctx->width,
+                                       1, size - 1, 1, size - 1,
+                                       st->block_rows, st->block_cols,
+                                       omega, 0.0, st->scratch);
+}
+
+/**
+ * Run up to depth sweeps in a single pass over the matrix, stopping
+ * after the first one that converges.
+ *
+ * The interior is split into blocks of block_rows rows, and sweep
+ * d + 1 follows at least one block behind sweep d. When it reaches
+ * block b, sweep d has finished block b + 1 below it, and block b - 1
+ * above it is at sweep d + 1 already, which is exactly the state a
+ * one-by-one sweep would see. The blocks are the strips sweep() uses,
+ * so the errors are summed in the same order and are bit-identical
+ * too.
+ * Far from convergence only a few blocks are live at a time, and they
+ * stay in cache while the sweeps pass over them.
+ *
+ * Sweep d + 1 must not run at all if sweep d converges. The running
+ * error of a sweep never decreases, so sweep d + 1 is held back until
+ * that of sweep d exceeds the tolerance. Close to convergence this
+ * degrades to one sweep after the other, which is still exact.
+ *
+ * \param omega Over-relaxation factor of all the sweeps
+ * \param errors Error of each sweep run
+ * \return Number of sweeps run
+ */
+static int
+fused_sweeps(struct gs_context *ctx, int depth, double omega, double *errors)
+{
+        struct seq_state *st = ctx->priv;
+        const int size = ctx->params.size;
+        const double tolerance = ctx->params.tolerance;
+        const int block_rows = st->block_rows;
+        const int nblocks = (size - 2 + block_rows - 1) / block_rows;
+        int *next = st->fused_next;
+        int progress = 1;
+
+        for (int d = 0; d < depth; d++) {
+                errors[d] = 0.0;
+                next[d] = 0;
+        }
+
+        while (progress) {
+                progress = 0;
+                for (int d = 0; d < depth; d++) {
+                        int b = next[d];
+                        int r0 = 1 + b * block_rows;
+                        int r1 = MIN(r0 + block_rows, size - 1);
+
+                        if (b == nblocks)
+                                continue;
+                        if (d > 0 && !(errors[d - 1] > tolerance &&
+                                       (next[d - 1] >= b + 2 ||
+                                        next[d - 1] == nblocks)))
+                                break;
+
+                        errors[d] = gs_kernel_sweep_blocked(
+                                ctx->matrix, ctx->width, r0, r1, 1, size - 1,
+                                block_rows, st->block_cols, omega,
+                                errors[d], st->scratch);
+                        next[d]++;
+                        progress = 1;
+                }
+        }
+
+        /* Sweeps are only held back for good if the one before them
+         * converged */
+        for (int d = 0; d < depth; d++) {
+                if (next[d] < nblocks)
+                        return d;
+                if (!(errors[d] > tolerance))
+                        return d + 1;
+        }
+        return depth;
+}
+
 /**
  *  Wrapper for the whole job. Fires the sweep a given number of time.
  */
-void
-gsi_calculate()
+static void
+seq_calculate(struct gs_context *ctx)
 {
+        const struct gs_params *p = &ctx->params;
+        double *fused_error = ((struct seq_state *)ctx->priv)->fused_error;
         int i;
-        double error = gs_tolerance + 1;
+        double error = p->tolerance + 1;
 
-        for(i = 0; i < gs_iterations && error > gs_tolerance; i++) {
-                error = sweep();
-                gs_verbose_printf("Iteration: %i, Error: %f\n", i, error);
-        }
+        /* Fused sweeps go by strips of rows, not tiles */
+        if (p->temporal_depth > 1 && p->size > 2 &&
+            p->layout == GS_LAYOUT_ROWS) {
+                /* Errors are only known at the end of a fused pass */
+                for (i = 0; i < p->iterations && error > p->tolerance; ) {
+                        int depth = MIN(p->temporal_depth, p->iterations - i);
+                        int n;
 
-        if (error <= gs_tolerance) {
-                printf("Solution converged after %i iterations.\n", i);
+                        /* A pass has a single omega */
+                        depth = MIN(depth, gs_ctx_omega_sweeps(ctx, i));
+                        n = fused_sweeps(ctx, depth, gs_ctx_omega(ctx),
+                                         fused_error);
+
+                        for (int d = 0; d < n; d++) {
+                                gs_verbose_printf(ctx,
+                                                  "Iteration: %i, Error: %f\n",
+                                                  i + d, fused_error[d]);
+                                gs_ctx_omega_observe(ctx, i + d,
+                                                     fused_error[d]);
+                        }
+                        error = fused_error[n - 1];
+                        i += n;
+                }
         } else {
-                printf("Reached maximum number of iterations. Solution did "
-                       "NOT converge.\n");
-                printf("Note: This is normal if you are using the "
-                       "default settings.\n");
+                for(i = 0; i < p->iterations && error > p->tolerance; i++) {
+                        error = sweep(ctx, gs_ctx_omega(ctx));
+                        gs_verbose_printf(ctx, "Iteration: %i, Error: %f\n",
+                                          i, error);
+                        gs_ctx_omega_observe(ctx, i, error);
+                }
         }
+
+        ctx->iterations = i;
+        ctx->error = error;
 }
 
+static const struct gs_backend seq_backend = {
+        .name = "seq",
+        .description = "Sequential lexicographic sweeps",
+        .options = GS_OPT_FUSE | GS_OPT_PANELS | GS_OPT_OMEGA,
+        .layouts = 1 << GS_LAYOUT_TILES | 1 << GS_LAYOUT_MORTON,
+        .init = seq_init,
+        .calculate = seq_calculate,
+        .finish = seq_finish,
+};
+
+GS_REGISTER_BACKEND(seq_backend)
+
 /*
  * Local Variables:
  * mode: c
@@ -0,0 +1,431 @@
+/**
+ * Routines for thread placement and memory placement reporting.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#if defined(__linux__)
+/* Needed for sched_getaffinity(), pthread_setaffinity_np() and syscall() */
+#define _GNU_SOURCE
+#endif
+
+#include "topology.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* Highest NUMA node we keep statistics for */
+#define MAX_NODES 64
+/* Number of pages queried per move_pages() call */
+#define PAGE_BATCH 1024
+
+/* CPUs to bind thread 0, 1, ... to, NULL if binding is disabled */
+static int *cpu_order = NULL;
+static int cpu_order_len = 0;
+static const char *binding_name = "none";
+
+#if defined(__linux__)
+
+/** Location of a CPU in the machine */
+struct cpu_info {
+        int cpu;
+        int package;
+        int core;
+        int core_rank;  /* Index of the core within its package */
+        int smt;        /* Index of the hardware thread within its core */
+};
+
+/* Sort order used by compare_cpus(), 1 for scatter, 0 for compact */
+static int sort_scatter;
+
+/**
+ * Read an integer from the sysfs topology directory of a CPU.
+ *
+ * \return The value, or 0 if it can't be read.
+ */
+static int
+read_topology(int cpu, const char *name)
+{
+        char path[128];
+        FILE *f;
+        int value = 0;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+        f = fopen(path, "r");
+        if (f) {
+                if (fscanf(f, "%d", &value) != 1)
+                        value = 0;
+                fclose(f);
+        }
+        return value;
+}
+
+static int
+compare_cpus(const void *_a, const void *_b)
+{
+        const struct cpu_info *a = _a, *b = _b;
+        int ka[3], kb[3];
+
+        if (sort_scatter) {
+                /* One thread per socket, then per core, then SMT siblings */
+                ka[0] = a->smt; ka[1] = a->core_rank; ka[2] = a->package;
+                kb[0] = b->smt; kb[1] = b->core_rank; kb[2] = b->package;
+        } else {
+                /* Fill a core, then a socket, before moving on */
+                ka[0] = a->package; ka[1] = a->core_rank; ka[2] = a->smt;
+                kb[0] = b->package; kb[1] = b->core_rank; kb[2] = b->smt;
+        }
+
+        for (int k = 0; k < 3; k++) {
+                if (ka[k] != kb[k])
+                        return ka[k] - kb[k];
+        }
+        return a->cpu - b->cpu;
+}
+
+/**
+ * Order the CPUs we are allowed to run on for compact or scatter
+ * binding.
+ */
+static int
+order_cpus(int scatter)
+{
+        cpu_set_t set;
+        struct cpu_info *info;
+        int n = 0;
+
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+                return -1;
+
+        info = malloc(CPU_COUNT(&set) * sizeof(*info));
+        cpu_order = malloc(CPU_COUNT(&set) * sizeof(*cpu_order));
+        if (!info || !cpu_order) {
+                fprintf(stderr, "Failed to allocate CPU list\n");
+                exit(EXIT_FAILURE);
+        }
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &set))
+                        continue;
+                info[n].cpu = cpu;
+                info[n].package = read_topology(cpu, "physical_package_id");
+                info[n].core = read_topology(cpu, "core_id");
+                n++;
+        }
+
+        for (int i = 0; i < n; i++) {
+                info[i].core_rank = 0;
+                info[i].smt = 0;
+                for (int j = 0; j < n; j++) {
+                        if (info[j].package != info[i].package)
+                                continue;
+                        if (info[j].core == info[i].core && j < i)
+                                info[i].smt++;
+                        /* Count each lower core once, by its first CPU */
+                        if (info[j].core < info[i].core) {
+                                int first = 1;
+                                for (int k = 0; k < j; k++) {
+                                        if (info[k].package == info[j].package &&
+                                            info[k].core == info[j].core)
+                                                first = 0;
+                                }
+                                info[i].core_rank += first;
+                        }
+                }
+        }
+
+        sort_scatter = scatter;
+        qsort(info, n, sizeof(*info), compare_cpus);
+        for (int i = 0; i < n; i++)
+                cpu_order[i] = info[i].cpu;
+        cpu_order_len = n;
+
+        free(info);
+        return 0;
+}
+
+/**
+ * Parse an explicit CPU list such as "0,2,8-11".
+ */
+static int
+parse_cpu_list(const char *spec)
+{
+        const char *p = spec;
+        int n = 0;
+
+        cpu_order = malloc(CPU_SETSIZE * sizeof(*cpu_order));
+        if (!cpu_order) {
+                fprintf(stderr, "Failed to allocate CPU list\n");
+                exit(EXIT_FAILURE);
+        }
+
+        while (*p) {
+                char *end;
+                long first = strtol(p, &end, 10), last;
+
+                if (end == p || first < 0 || first >= CPU_SETSIZE)
+                        return -1;
+                last = first;
+                p = end;
+                if (*p == '-') {
+                        last = strtol(p + 1, &end, 10);
+                        if (end == p + 1 || last < first || last >= CPU_SETSIZE)
+                                return -1;
+                        p = end;
+                }
+                for (long cpu = first; cpu <= last && n < CPU_SETSIZE; cpu++)
+                        cpu_order[n++] = cpu;
+
+                if (*p == ',')
+                        p++;
+                else if (*p)
+                        return -1;
+        }
+
+        cpu_order_len = n;
+        return n > 0 ? 0 : -1;
+}
+
+#endif
+
+int
+topology_default_nthreads()
+{
+#if defined(__linux__)
+        cpu_set_t set;
+
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+                return CPU_COUNT(&set);
+#endif
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? (int)n : 0;
+}
+
+int
+topology_set_binding(const char *spec)
+{
+        free(cpu_order);
+        cpu_order = NULL;
+        cpu_order_len = 0;
+        binding_name = "none";
+
+        if (!strcmp(spec, "none"))
+                return 0;
+
+#if defined(__linux__)
+        int ret;
+
+        if (!strcmp(spec, "compact"))
+                ret = order_cpus(0);
+        else if (!strcmp(spec, "scatter"))
+                ret = order_cpus(1);
+        else
+                ret = parse_cpu_list(spec);
+
+        if (ret != 0) {
+                free(cpu_order);
+                cpu_order = NULL;
+                cpu_order_len = 0;
+                return -1;
+        }
+
+        binding_name = spec;
+        return 0;
+#else
+        return -1;
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * Read an attribute of cache index of CPU 0 from sysfs.
+ *
+ * \return 0 on success, -1 if it isn't there
+ */
+static int
+read_cache_attr(int index, const char *name, char *buf, int len)
+{
+        char path[128];
+        FILE *f;
+        int ret;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/%s",
+                 index, name);
+        f = fopen(path, "r");
+        if (!f)
+                return -1;
+        ret = fgets(buf, len, f) ? 0 : -1;
+        fclose(f);
+
+        return ret;
+}
+#endif
+
+int
+topology_cache_info(int level, struct topology_cache *cache)
+{
+        memset(cache, 0, sizeof(*cache));
+
+#if defined(__linux__)
+        for (int index = 0; ; index++) {
+                char buf[32], type[32];
+                unsigned long value;
+                char unit = 0;
+                int cache_level;
+
+                if (read_cache_attr(index, "level", buf, sizeof(buf)) != 0)
+                        break;
+                if (sscanf(buf, "%d", &cache_level) != 1 ||
+                    cache_level != level)
+                        continue;
+
+                if (read_cache_attr(index, "type", buf, sizeof(buf)) != 0 ||
+                    sscanf(buf, "%31s", type) != 1 ||
+                    (strcmp(type, "Data") && strcmp(type, "Unified")))
+                        continue;
+
+                if (read_cache_attr(index, "size", buf, sizeof(buf)) == 0 &&
+                    sscanf(buf, "%lu%c", &value, &unit) >= 1) {
+                        if (unit == 'K')
+                                value *= 1024;
+                        else if (unit == 'M')
+                                value *= 1024 * 1024;
+                        cache->size = value;
+                }
+                if (read_cache_attr(index, "coherency_line_size",
+                                    buf, sizeof(buf)) == 0)
+                        cache->line_size = atoi(buf);
+                if (read_cache_attr(index, "ways_of_associativity",
+                                    buf, sizeof(buf)) == 0)
+                        cache->ways = atoi(buf);
+                if (read_cache_attr(index, "number_of_sets",
+                                    buf, sizeof(buf)) == 0)
+                        cache->sets = atoi(buf);
+        }
+
+#if defined(_SC_LEVEL1_DCACHE_SIZE)
+        if (!cache->size) {
+                long value = -1;
+
+                if (level == 1)
+                        value = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+                else if (level == 2)
+                        value = sysconf(_SC_LEVEL2_CACHE_SIZE);
+                else if (level == 3)
+                        value = sysconf(_SC_LEVEL3_CACHE_SIZE);
+                cache->size = value > 0 ? value : 0;
+        }
+#endif
+#else
+        (void)level;
+#endif
+        return cache->size ? 0 : -1;
+}
+
+size_t
+topology_cache_size(int level)
+{
+        struct topology_cache cache;
+
+        topology_cache_info(level, &cache);
+        return cache.size;
+}
+
+const char *
+topology_binding_name()
+{
+        return binding_name;
+}
+
+void
+topology_bind_thread(int tid)
+{
+#if defined(__linux__)
+        cpu_set_t set;
+        int cpu, err;
+
+        if (!cpu_order)
+                return;
+
+        cpu = cpu_order[tid % cpu_order_len];
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+                fprintf(stderr, "Warning: Failed to bind thread %d to CPU %d: %s\n",
+                        tid, cpu, strerror(err));
+#else
+        (void)tid;
+#endif
+}
+
+void
+topology_report_pages(const void *addr, size_t len)
+{
+#if defined(__linux__) && defined(SYS_move_pages)
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const char *start = (const char *)((size_t)addr & ~(page_size - 1));
+        const char *end = (const char *)addr + len;
+        long per_node[MAX_NODES] = { 0 };
+        long absent = 0, total = 0;
+
+        while (start < end) {
+                void *pages[PAGE_BATCH];
+                int status[PAGE_BATCH];
+                int n = 0;
+
+                for (; n < PAGE_BATCH && start < end; n++, start += page_size)
+                        pages[n] = (void *)start;
+
+                /* With a NULL node list, move_pages() only reports where
+                 * each page currently lives */
+                if (syscall(SYS_move_pages, 0, (unsigned long)n, pages,
+                            NULL, status, 0) != 0) {
+                        printf("Page placement: unavailable (%s)\n",
+                               strerror(errno));
+                        return;
+                }
+
+                for (int i = 0; i < n; i++) {
+                        if (status[i] >= 0 && status[i] < MAX_NODES)
+                                per_node[status[i]]++;
+                        else
+                                absent++;
+                }
+                total += n;
+        }
+
+        printf("Page placement (%ld pages):", total);
+        for (int node = 0; node < MAX_NODES; node++) {
+                if (per_node[node])
+                        printf(" node %d: %.1f%%", node,
+                               100.0 * per_node[node] / total);
+        }
+        if (absent)
+                printf(" not present: %.1f%%", 100.0 * absent / total);
+        printf("\n");
+#else
+        (void)addr; (void)len;
+        printf("Page placement: unavailable on this platform\n");
+#endif
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,90 @@
+/**
+ * Routines for thread placement and memory placement reporting.
+ *
+ * Course: Advanced Computer Architecture, Uppsala University
+ * Course Part: Lab assignment 3
+ *
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stddef.h>
+
+/**
+ * Get the number of CPUs this process is allowed to run on.
+ *
+ * \return Number of CPUs, or 0 if it can't be determined.
+ */
+extern int topology_default_nthreads();
+
+/**
+ * Select how threads are bound to CPUs.
+ *
+ * \param spec "none", "compact" (fill the cores of one socket
+ *             before moving on), "scatter" (spread threads over
+ *             sockets and physical cores first) or an explicit list of
+ *             CPUs such as "0,2,8-11".
+ * \return 0 on success, -1 if spec is invalid or binding isn't
+ *         supported on this platform.
+ */
+extern int topology_set_binding(const char *spec);
+
+/**
+ * Get the size of the data (or unified) cache at a level of the cache
+ * hierarchy, as seen by CPU 0.
+ *
+ * \param level 1 for L1, 2 for L2, ...
+ * \return Size in bytes, or 0 if it can't be determined.
+ */
+extern size_t topology_cache_size(int level);
+
+/** Geometry of a cache */
+struct topology_cache {
+        /** Size in bytes */
+        size_t size;
+        /** Bytes per line, 0 if unknown */
+        int line_size;
+        /** Lines per set, 0 if unknown or fully associative */
+        int ways;
+        /** Number of sets, 0 if unknown */
+        int sets;
+};
+
+/**
+ * Get the geometry of the data (or unified) cache at a level of the
+ * cache hierarchy, as seen by CPU 0. Only the size may be known on
+ * some systems.
+ *
+ * \param level 1 for L1, 2 for L2, ...
+ * \return 0 on success, -1 if not even the size can be determined.
+ */
+extern int topology_cache_info(int level, struct topology_cache *cache);
+
+/**
+ * Get a printable description of the selected binding.
+ */
+extern const char *topology_binding_name();
+
+/**
+ * Bind the calling thread to the CPU selected for thread tid. Does
+ * nothing if no binding has been selected.
+ */
+extern void topology_bind_thread(int tid);
+
+/**
+ * Print how the pages in [addr, addr + len) are distributed over the
+ * NUMA nodes of the system.
+ */
+extern void topology_report_pages(const void *addr, size_t len);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * c-file-style: "linux"
+ * End:
+ */